@@ -1,29 +1,276 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define KEY_ENTER '\r'
+#define KEY_ESCAPE '\x1b'
 #define KEY_BACKSPACE 127
 
+// Keys decoded from escape sequences are numbered right after the byte range,
+// so that every key indexes the keymap
+#define KEY_NONE -1
+#define KEY_LEFT 256
+#define KEY_RIGHT 257
+#define KEY_UP 258
+#define KEY_DOWN 259
+#define KEY_HOME 260
+#define KEY_END 261
+#define KEY_PASTE_START 262
+#define KEY_PASTE 263               // The pasted text is waiting in the paste buffer
+#define N_KEYS 264
+
+#define PASTE_END "\x1b[201~"
+
 #define CTRL_PLUS(k) ((k) & 0x1f)
 
+#define N_SIZE_CLASSES 25
+
+// Fixed-size blocks that the arena carves allocations out of
+struct block {
+    struct block *next;
+    size_t used;
+    char data[];
+};
+
+// Allocations bigger than the largest size class each get their own chunk
+struct large {
+    struct large *prev;
+    struct large *next;
+    size_t size;
+    char data[];
+};
+
+struct alloc_stats {
+    size_t allocs;
+    size_t frees;
+    size_t in_use;              // Bytes handed out, rounded up to their size class
+    size_t peak_in_use;
+    size_t blocks;
+    size_t large;
+    size_t class_allocs[N_SIZE_CLASSES];
+    size_t class_in_use[N_SIZE_CLASSES];
+};
+
+// Slab allocator for everything a buffer owns: freed chunks go back on a free
+// list for their size class, and closing the buffer hands all of its blocks
+// back at once instead of freeing each row
+struct arena {
+    struct block *blocks;
+    struct block *last_block;
+    struct large *large;
+    void *free_lists[N_SIZE_CLASSES];
+    struct alloc_stats stats;
+};
+
+// Where a character starts, every COLUMN_STRIDE bytes or so of a long row
+struct checkpoint {
+    size_t byte;
+    size_t column;
+};
+
+struct columns {
+    size_t capacity;
+    size_t count;
+    struct checkpoint points[];
+};
+
+// Where a row is broken into visual lines when it does not fit on the screen
+struct wraps {
+    size_t capacity;
+    size_t count;
+    int width;                  // Screen width they were worked out for
+    size_t starts[];            // Byte that each visual line after the first starts at
+};
+
+// Edited rows keep their bytes in storage from the arena. Splitting a row
+// leaves both halves in the same storage, so neither has to be copied, and the
+// storage goes back to the arena once no row is using it any more
+struct storage {
+    int refs;
+    size_t size;
+    char data[];
+};
+
+// Each row is a gap buffer: the text before the gap lives at data[0, gap) and
+// the text after it at data[gap + capacity - size, capacity). A borrowed row
+// points straight into the file mapping and is copied out on its first edit.
+// The flags go last, in what would otherwise be padding, so a row takes one cache line
 struct row {
     size_t size;
+    size_t capacity;
+    size_t gap;
     char *data;
+    struct storage *storage;    // What data points into, unless the row is borrowed
+    struct columns *columns;    // Built the first time a long multibyte row needs it
+    struct wraps *wraps;        // Built the first time the row is drawn wrapped
+    bool borrowed;
+    unsigned char hl_start;     // Highlighter state at the start and end of the row
+    unsigned char hl_end;
+    bool hl_dirty;              // Edited since it was last highlighted
+    unsigned char text;         // Whether the row is all ASCII, if known yet
 };
 
-struct {
+#define LEAF_ROWS 64
+#define NODE_CHILDREN 32
+#define BLOOM_BITS 8192
+
+// The document is a B+ tree of rows indexed by line number. Leaves hold the
+// rows themselves and every node knows how many rows are below it, so finding,
+// inserting and removing a line is O(log n) and never touches the whole file.
+// Nodes also add up the bytes below them, so a byte offset is found the same way
+struct node {
+    bool leaf;
+    bool dirty;                 // A leaf's rows changed since a search last indexed them
+    bool bytes_stale;           // Rows below changed since n_bytes was added up
+    int count;
     size_t n_rows;
-    struct row *rows;
+    size_t n_bytes;             // In the rows below, with a newline after each
+    uint64_t *bloom;            // Trigrams in a leaf's rows, BLOOM_BITS wide
+    size_t cache_search;        // Search whose match list holds this leaf's matches
+    size_t cache_start;
+    size_t cache_count;
+    size_t cache_first_row;     // Where the leaf started in the document back then
+    union {
+        struct row rows[LEAF_ROWS];
+        struct node *children[NODE_CHILDREN];
+    };
+};
+
+// One journal entry: text that was inserted at or deleted from (y, x), where
+// a newline in text stands for a line break
+struct edit {
+    size_t group;               // Edits made by one keystroke share this, and are undone together
+    bool insert;
+    bool borrowed;              // text lives in the buffer's arena rather than the journal
+    bool multiline;
+    bool replace;               // A replace all instead, see struct replace_header; insert means forward
+    size_t y;
+    size_t x;
+    size_t length;
+    size_t capacity;
+    char *text;
+};
+
+// Ring of the most recent edits. The first `applied` entries from the oldest
+// are in the document, the rest can be redone
+struct journal {
+    struct edit *edits;
+    size_t first;
+    size_t count;
+    size_t applied;
+    size_t bytes;
+    bool mergeable;             // Whether the next keystroke may extend the newest entry
+    size_t group;               // Of the newest entry
+    bool batching;              // Edits go into the newest entry's group instead of starting one
+};
+
+// A file mapped into memory. Buffers that open the same file share one
+// mapping, which is dropped when the last of them lets go of it
+struct mapping {
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    struct timespec mtime;
+    int fd;
+    const char *data;
+    int refs;
+    struct mapping *next;
+
+    // Files too big to index up front have their newlines counted per stripe
+    // in the background, so a line far into them is found by reading one stripe
+    size_t n_stripes;
+    struct stripe *stripes;
+    size_t counted;             // Stripes before this one have been counted
+    size_t *lines;              // Newlines before the start of each stripe, up to counted
+    struct cancel_token *token;
+};
+
+// Text pasted into a buffer, which rows and undo entries borrow from
+struct pasted {
+    struct pasted *next;
+    size_t capacity;
+    char text[];
+};
+
+struct cursor {
+    size_t y;
+    size_t x;
+};
+
+struct buffer {
+    struct arena arena;         // Everything the document is made of, so it can be let go of at once
+    struct node *root;
+    struct journal journal;
+    struct pasted *pasted;
+
+    char *filename;
+    struct mapping *mapping;
+    int map_fd;                 // The mapping's, kept open so saving can copy unchanged spans
+    const char *map;
+    size_t map_size;
+    bool trailing_newline;      // Whether the last row ends with a newline on disk
+    size_t indexed;             // Bytes of map that have been split into rows
+    bool highlight;
+    size_t highlighted;         // Rows before this have up to date highlighter states
+    int follow_watch;           // Inotify watch while appends to the file are followed, or -1
+    size_t followed;            // Bytes of the file that are in the document
+    struct pasted *follow_block;    // Where appended bytes are read into, followed by follow_used
+    size_t follow_used;
+    struct swap *swap;          // Where edits are logged for recovery, from the first one on
+    bool streaming;             // Too big to index, so only a window of rows around the cursor is kept
+    bool pinned;                // The window has been edited, and stays put from then on
+    size_t window_start;        // Offset in map of the first row
 
     size_t cx;
     size_t cy;
-} buffer;
+    struct cursor *cursors;     // More cursors, in document order and never at (cx, cy)
+    size_t n_cursors;
+    size_t cursor_capacity;
+    size_t row_offset;          // Where the screen was scrolled to while another buffer was shown
+    size_t col_offset;
+    size_t wrap_offset;
+};
+
+// The buffer on screen, which every editing function works on
+struct buffer *buffer;
+
+struct {
+    size_t count;
+    size_t capacity;
+    struct buffer **list;
+    size_t current;
+    struct mapping *mappings;
+} buffers;
 
 struct termios reset_termios;
 
@@ -34,10 +281,152 @@ void die(const char *error) {
     exit(EXIT_FAILURE);
 }
 
+/* Instrumentation */
+
+// Build with -DINSTRUMENT to time every stage between a read from the
+// terminal and the frame it caused being written back, and to count what
+// that took. The numbers go to the file named by EDITOR_LATENCY_STATS at
+// exit and on SIGUSR1. Without it all of this compiles to nothing
+#define STAGE_DECODE 0
+#define STAGE_EDIT 1            // Handling the decoded keys, which is where the document changes
+#define STAGE_RENDER 2
+#define STAGE_FLUSH 3
+#define STAGE_EVENT 4           // From the read returning to the frame being written
+#define N_STAGES 5
+
+#ifdef INSTRUMENT
+
+// Buckets are linear within each power of two, 16 of them, so any value is
+// off by at most 1/16 while the whole range of 64 bits fits in 1024 counts
+#define SUB_BUCKETS 16
+#define N_BUCKETS (64 * SUB_BUCKETS)
+
+struct histogram {
+    uint64_t counts[N_BUCKETS];
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+};
+
+const char *stage_names[N_STAGES] = { "decode", "edit", "render", "flush", "event" };
+
+struct {
+    struct histogram stages[N_STAGES];  // In nanoseconds
+    struct histogram syscalls;          // Per event
+    struct histogram bytes;             // Written per event
+    bool in_event;
+    uint64_t event_start;
+    uint64_t event_syscalls;
+    uint64_t event_bytes;
+    uint64_t total_syscalls;
+    uint64_t total_bytes;
+} instrument;
+
+uint64_t stage_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) return value;
+    int shift = 63 - __builtin_clzll(value) - 4;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+void record_value(struct histogram *histogram, uint64_t value) {
+    histogram->counts[bucket_of(value)]++;
+    if (histogram->count == 0 || value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+    histogram->count++;
+}
+
+uint64_t percentile(struct histogram *histogram, double fraction) {
+    uint64_t rank = histogram->count * fraction;
+    uint64_t seen = 0;
+    for (int i = 0; i < N_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) return bucket_value(i);
+    }
+    return histogram->max;
+}
+
+void record_stage(int stage, uint64_t start) {
+    record_value(&instrument.stages[stage], stage_clock() - start);
+}
+
+void count_syscall(size_t bytes) {
+    instrument.total_syscalls++;
+    instrument.total_bytes += bytes;
+    instrument.event_syscalls++;
+    instrument.event_bytes += bytes;
+}
+
+// Called once input has been read, so its syscall counts towards the event
+void begin_event() {
+    if (instrument.in_event) return;
+    instrument.in_event = true;
+    instrument.event_start = stage_clock();
+    instrument.event_syscalls = 0;
+    instrument.event_bytes = 0;
+}
+
+void end_event() {
+    if (!instrument.in_event) return;
+    instrument.in_event = false;
+    record_stage(STAGE_EVENT, instrument.event_start);
+    record_value(&instrument.syscalls, instrument.event_syscalls);
+    record_value(&instrument.bytes, instrument.event_bytes);
+}
+
+void dump_histogram(FILE *file, const char *name, struct histogram *histogram, double scale) {
+    if (histogram->count == 0) return;
+    fprintf(file, "  %-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long)histogram->count, histogram->min / scale,
+            percentile(histogram, 0.5) / scale, percentile(histogram, 0.9) / scale,
+            percentile(histogram, 0.99) / scale, percentile(histogram, 0.999) / scale, histogram->max / scale);
+}
+
+void write_latency_stats() {
+    const char *path = getenv("EDITOR_LATENCY_STATS");
+    if (path == NULL) return;
+
+    FILE *file = fopen(path, "a");
+    if (file == NULL) return;
+    fprintf(file, "latency (us)      count        min        p50        p90        p99      p99.9        max\n");
+    for (int i = 0; i < N_STAGES; i++) {
+        dump_histogram(file, stage_names[i], &instrument.stages[i], 1000.0);
+    }
+    fprintf(file, "per event\n");
+    dump_histogram(file, "syscalls", &instrument.syscalls, 1.0);
+    dump_histogram(file, "bytes", &instrument.bytes, 1.0);
+    fprintf(file, "total: %llu syscalls, %llu bytes written\n",
+            (unsigned long long)instrument.total_syscalls, (unsigned long long)instrument.total_bytes);
+    fclose(file);
+}
+
+#else
+
+uint64_t stage_clock() { return 0; }
+void record_stage(int stage, uint64_t start) {}
+void count_syscall(size_t bytes) {}
+void begin_event() {}
+void end_event() {}
+void write_latency_stats() {}
+
+#endif
+
 /* Terminal io */
 
 // NOTE: Don't call this, it is automatically scheduled by enable_raw_mode
 void disable_raw_mode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &reset_termios);
 }
 
@@ -52,220 +441,5584 @@ void enable_raw_mode() {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
 
-    raw.c_cc[VMIN] = 0;             // Minimum characters to read
-    raw.c_cc[VTIME] = 1;            // Delay when reading in 10ths of a second
+    raw.c_cc[VMIN] = 0;             // Reads never block, the event loop waits for input instead
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
-/* Buffer manipulation */
+// Everything the editor reads from or draws on the terminal goes through
+// here, so that the benchmarks can put a script in place of the tty
+struct terminal {
+    ssize_t (*read)(char *bytes, size_t size);
+    ssize_t (*write)(const char *bytes, size_t size);
+    void (*get_size)(int *rows, int *cols);
+};
 
-void init_row(struct row *row) {
-    row->size = 0;
-    row->data = malloc(0);
+ssize_t tty_read(char *bytes, size_t size) {
+    return read(STDIN_FILENO, bytes, size);
 }
 
-void init_buffer() {
-    buffer.n_rows = 1;
-    buffer.rows = malloc(buffer.n_rows * sizeof(struct row));
-    init_row(&buffer.rows[0]);
+ssize_t tty_write(const char *bytes, size_t size) {
+    return write(STDOUT_FILENO, bytes, size);
+}
 
-    buffer.cx = 0;
-    buffer.cy = 0;
+void tty_get_size(int *rows, int *cols) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0 || ws.ws_col == 0) {
+        *rows = 24;
+        *cols = 80;
+    } else {
+        *rows = ws.ws_row;
+        *cols = ws.ws_col;
+    }
 }
 
+struct terminal terminal = { .read = tty_read, .write = tty_write, .get_size = tty_get_size };
 
-void insert_char(struct row *row, int index, char c) {
-    row->size++;
-    row->data = realloc(row->data, row->size);
-    memmove(&row->data[index + 1], &row->data[index], row->size - index - 1);
-    row->data[index] = c;
+/* Event loop */
+
+#define MAX_WATCHES 16
+#define MAX_TIMERS 16
+
+struct watch {
+    int fd;
+    void (*callback)(void *data);
+    void *data;
+};
+
+struct timer {
+    bool active;
+    long long deadline;
+    int interval;               // Milliseconds between repeats, or 0 to fire once
+    void (*callback)(void *data);
+    void *data;
+};
+
+struct {
+    int n_watches;
+    struct pollfd fds[MAX_WATCHES];
+    struct watch watches[MAX_WATCHES];
+    struct timer timers[MAX_TIMERS];
+    int signal_pipe[2];
+} loop;
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-void remove_char(struct row *row, int index) {
-    row->size--;
-    memmove(&row->data[index], &row->data[index + 1], 1);
+// Calls callback whenever fd becomes readable
+void watch_fd(int fd, void (*callback)(void *data), void *data) {
+    if (loop.n_watches == MAX_WATCHES) die("watch_fd");
+
+    loop.fds[loop.n_watches] = (struct pollfd){ .fd = fd, .events = POLLIN };
+    loop.watches[loop.n_watches] = (struct watch){ .fd = fd, .callback = callback, .data = data };
+    loop.n_watches++;
 }
 
+void unwatch_fd(int fd) {
+    for (int i = 0; i < loop.n_watches; i++) {
+        if (loop.watches[i].fd != fd) continue;
 
-void insert_row(int index) {
-    buffer.n_rows++;
-    buffer.rows = realloc(buffer.rows, buffer.n_rows * sizeof(struct row));
-    memmove(&buffer.rows[index + 1], &buffer.rows[index], (buffer.n_rows - index - 1) * sizeof(struct row));
-    init_row(&buffer.rows[index]);
+        loop.n_watches--;
+        loop.fds[i] = loop.fds[loop.n_watches];
+        loop.watches[i] = loop.watches[loop.n_watches];
+        return;
+    }
 }
 
-void concat_row(struct row *dest, struct row *src) {
-    dest->size += src->size;
-    dest->data = realloc(dest->data, dest->size);
-    memcpy(&dest->data[dest->size - src->size], src->data, src->size);
+// Calls callback after delay milliseconds, and then every interval milliseconds
+// if interval is not 0. Returns an id for cancel_timer
+int add_timer(int delay, int interval, void (*callback)(void *data), void *data) {
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (loop.timers[i].active) continue;
+
+        loop.timers[i] = (struct timer){
+            .active = true,
+            .deadline = now_ms() + delay,
+            .interval = interval,
+            .callback = callback,
+            .data = data,
+        };
+        return i;
+    }
+
+    die("add_timer");
+    return -1;
 }
 
-void remove_row(int index) {
-    buffer.n_rows--;
-    memmove(&buffer.rows[index], &buffer.rows[index + 1], buffer.n_rows - index);
+void cancel_timer(int id) {
+    if (id >= 0) loop.timers[id].active = false;
 }
 
-/* Printing */
+int next_timeout() {
+    long long now = now_ms();
+    long long timeout = -1;
 
-void write_char(char c) {
-    if (write(STDOUT_FILENO, &c, 1) != 1) die("write_char");
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (!loop.timers[i].active) continue;
+
+        long long remaining = loop.timers[i].deadline - now;
+        if (remaining < 0) remaining = 0;
+        if (timeout == -1 || remaining < timeout) timeout = remaining;
+    }
+    return timeout;
 }
 
-void write_string(const char *string) {
-    if (write(STDOUT_FILENO, string, strlen(string)) != strlen(string)) die("write_string");
+void run_timers() {
+    long long now = now_ms();
+
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        struct timer *timer = &loop.timers[i];
+        if (!timer->active || timer->deadline > now) continue;
+
+        if (timer->interval > 0) {
+            timer->deadline = now + timer->interval;
+        } else {
+            timer->active = false;
+        }
+        timer->callback(timer->data);
+    }
 }
 
-void write_row(struct row *row) {
-    if (write(STDOUT_FILENO, row->data, row->size) != row->size) die("write_row");
+// Blocks until some input, signal or timer is due and dispatches it
+void poll_events() {
+    int ready = poll(loop.fds, loop.n_watches, next_timeout());
+    if (ready == -1 && errno != EINTR) die("poll");
+    count_syscall(0);
+
+    for (int i = 0; ready > 0 && i < loop.n_watches; i++) {
+        if (loop.fds[i].revents == 0) continue;
+
+        loop.fds[i].revents = 0;
+        loop.watches[i].callback(loop.watches[i].data);
+    }
+    run_timers();
+}
+
+// Signals are turned into bytes on a pipe so they are handled inside the loop
+void signal_to_pipe(int signal) {
+    int saved = errno;
+    unsigned char byte = signal;
+    write(loop.signal_pipe[1], &byte, 1);
+    errno = saved;
+}
+
+void watch_signal(int signal) {
+    struct sigaction action = { .sa_handler = signal_to_pipe, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signal, &action, NULL) == -1) die("sigaction");
+}
+
+void init_event_loop(void (*on_signal)(void *data)) {
+    loop.n_watches = 0;
+    if (pipe2(loop.signal_pipe, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+    watch_fd(loop.signal_pipe[0], on_signal, NULL);
+}
+
+/* Thread pool */
+
+// Heavy work runs as jobs on a pool of threads. Each thread has a queue of
+// its own, taking the newest job from it and stealing the oldest from the
+// others when it runs dry. Finished jobs come back through a pipe watched by
+// the event loop, which calls their done callbacks on the main thread
+#define MAX_POOL_THREADS 64
+
+// Shared by a group of jobs so they can be called off together
+struct cancel_token {
+    atomic_bool cancelled;
+    size_t pending;             // Jobs submitted and not finished yet, guarded by pool.lock
+};
+
+struct job {
+    void (*run)(struct job *job, int worker);
+    void (*done)(struct job *job);
+    void *data;
+    struct cancel_token *token;
+    struct job *next;
+};
+
+struct job_queue {
+    pthread_mutex_t lock;
+    struct job **jobs;          // Ring of capacity jobs starting at head
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+struct {
+    int n_threads;
+    pthread_t threads[MAX_POOL_THREADS];
+    struct job_queue queues[MAX_POOL_THREADS];
+    int next_queue;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signalled when jobs are submitted
+    pthread_cond_t finished;    // Broadcast when a job finishes
+    size_t queued;
+
+    pthread_mutex_t done_lock;
+    struct job *first_done;
+    struct job *last_done;
+    int done_pipe[2];
+} pool;
+
+bool cancelled(struct cancel_token *token) {
+    return atomic_load(&token->cancelled);
 }
 
-void write_buffer() {
-    for (int i = 0; i < buffer.n_rows; i++) {
-        write_row(&buffer.rows[i]);
-        write_string("\r\n");
+void push_job(struct job_queue *queue, struct job *job) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        struct job **jobs = malloc(capacity * sizeof(struct job *));
+        if (jobs == NULL) die("push_job");
+        for (size_t i = 0; i < queue->count; i++) {
+            jobs[i] = queue->jobs[(queue->head + i) % queue->capacity];
+        }
+        free(queue->jobs);
+        queue->jobs = jobs;
+        queue->head = 0;
+        queue->capacity = capacity;
     }
+    queue->jobs[(queue->head + queue->count++) % queue->capacity] = job;
+    pthread_mutex_unlock(&queue->lock);
 }
 
-void clear_screen() {
-    write_string("\x1b[2J");
-    write_string("\x1b[1;1H");
+// Takes the newest job of a thread's own queue, or the oldest of someone else's
+struct job *pop_job(struct job_queue *queue, bool steal) {
+    struct job *job = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        queue->count--;
+        if (steal) {
+            job = queue->jobs[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        } else {
+            job = queue->jobs[(queue->head + queue->count) % queue->capacity];
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
 }
 
-/* Terminal manipulation */
+struct job *take_job(int worker) {
+    struct job *job = pop_job(&pool.queues[worker], false);
+    for (int i = 1; job == NULL && i < pool.n_threads; i++) {
+        job = pop_job(&pool.queues[(worker + i) % pool.n_threads], true);
+    }
+    return job;
+}
+
+void *pool_worker(void *data) {
+    int worker = (int)(intptr_t)data;
+
+    while (true) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.queued == 0) pthread_cond_wait(&pool.wake, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        // A job counted in queued may be in flight between queues, so keep looking
+        struct job *job = take_job(worker);
+        if (job == NULL) continue;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.queued--;
+        pthread_mutex_unlock(&pool.lock);
+
+        // Once the job is handed back it may be freed at any moment
+        struct cancel_token *token = job->token;
+        if (!cancelled(token)) job->run(job, worker);
+
+        // Cancelled jobs are not handed back, whoever cancelled them cleans up
+        if (!cancelled(token)) {
+            pthread_mutex_lock(&pool.done_lock);
+            job->next = NULL;
+            if (pool.last_done != NULL) pool.last_done->next = job;
+            else pool.first_done = job;
+            pool.last_done = job;
+            pthread_mutex_unlock(&pool.done_lock);
+
+            // The pipe only needs to be readable, so a full one is as good as a write
+            write(pool.done_pipe[1], "", 1);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        token->pending--;
+        pthread_cond_broadcast(&pool.finished);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+void submit_job(struct job *job) {
+    pthread_mutex_lock(&pool.lock);
+    job->token->pending++;
+    pthread_mutex_unlock(&pool.lock);
 
-void set_row(int row) {
-    write_string("\x1b[");
-    int length = snprintf(NULL, 0, "%d", row) + 1;
-    char number[length];
-    snprintf(number, length, "%d", row);
-    write_string(number);
-    write_string("H");
+    push_job(&pool.queues[pool.next_queue], job);
+    pool.next_queue = (pool.next_queue + 1) % pool.n_threads;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.queued++;
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
 }
 
-void set_column(int column) {
-    write_string("\x1b[");
-    int length = snprintf(NULL, 0, "%d", column) + 1;
-    char number[length];
-    snprintf(number, length, "%d", column);
-    write_string(number);
-    write_string("G");
+void reset_token(struct cancel_token *token) {
+    atomic_store(&token->cancelled, false);
 }
 
-/* Processing */
+// Calls off every job of token and waits for the ones already running, after
+// which none of them is touching anything and none of their done callbacks will run
+void cancel_jobs(struct cancel_token *token) {
+    atomic_store(&token->cancelled, true);
+
+    pthread_mutex_lock(&pool.lock);
+    while (token->pending > 0) pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_lock(&pool.done_lock);
+    struct job **link = &pool.first_done;
+    pool.last_done = NULL;
+    while (*link != NULL) {
+        if ((*link)->token == token) {
+            *link = (*link)->next;
+        } else {
+            pool.last_done = *link;
+            link = &(*link)->next;
+        }
+    }
+    pthread_mutex_unlock(&pool.done_lock);
+}
+
+void finish_jobs(void *data) {
+    char bytes[256];
+    while (read(pool.done_pipe[0], bytes, sizeof(bytes)) > 0) {}
+
+    // One at a time, since a callback may cancel other jobs and free them
+    while (true) {
+        pthread_mutex_lock(&pool.done_lock);
+        struct job *job = pool.first_done;
+        if (job != NULL) pool.first_done = job->next;
+        if (pool.first_done == NULL) pool.last_done = NULL;
+        pthread_mutex_unlock(&pool.done_lock);
+
+        if (job == NULL) return;
+        job->done(job);
+    }
+}
+
+void init_pool() {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+    pthread_mutex_init(&pool.done_lock, NULL);
+    if (pipe2(pool.done_pipe, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+    watch_fd(pool.done_pipe[0], finish_jobs, NULL);
 
-char read_key_press() {
-    int chars_read;
-    char c;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.n_threads = cpus < 1 ? 1 : cpus > MAX_POOL_THREADS ? MAX_POOL_THREADS : cpus;
+    for (int i = 0; i < pool.n_threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, (void *)(intptr_t)i) != 0) die("pthread_create");
+    }
+}
+
+/* Line scanning */
+
+#define INDEX_CHUNK_ROWS 256
+
+// Each scanner writes the offset just past every newline in data to starts,
+// stopping once max offsets have been written, and returns how many it wrote
+
+size_t scan_line_starts_scalar(const char *data, size_t length, size_t *starts, size_t max) {
+    size_t count = 0;
+    for (size_t i = 0; i < length && count < max; i++) {
+        if (data[i] == '\n') starts[count++] = i + 1;
+    }
+    return count;
+}
 
-    while ((chars_read = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (chars_read == -1) die("read");
+// Finishes a vector scan that stopped at byte i with count starts found
+size_t scan_tail(const char *data, size_t length, size_t i, size_t *starts, size_t count, size_t max) {
+    size_t tail = scan_line_starts_scalar(&data[i], length - i, &starts[count], max - count);
+    for (size_t j = count; j < count + tail; j++) starts[j] += i;
+    return count + tail;
+}
+
+// Appends the line starts for a bitmask of newline positions found at base
+#define EMIT_NEWLINES(mask, base) \
+    while (mask != 0) { \
+        starts[count++] = (base) + __builtin_ctzll(mask) + 1; \
+        if (count == max) return count; \
+        mask &= mask - 1; \
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t scan_line_starts_sse2(const char *data, size_t length, size_t *starts, size_t max) {
+    size_t count = 0;
+    if (max == 0) return 0;
+
+    size_t i = 0;
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)&data[i]);
+        unsigned long long mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        EMIT_NEWLINES(mask, i);
     }
 
-    return c;
+    return scan_tail(data, length, i, starts, count, max);
 }
 
-void handle_key_press() {
-    char c = read_key_press();
+__attribute__((target("avx2")))
+size_t scan_line_starts_avx2(const char *data, size_t length, size_t *starts, size_t max) {
+    size_t count = 0;
+    if (max == 0) return 0;
 
-    if (c == CTRL_PLUS('q')) {
-        clear_screen();
-        write_buffer();
-        exit(EXIT_FAILURE);
-    } else if (c == KEY_ENTER) {
-        insert_row(buffer.cy + 1);
-        buffer.rows[buffer.cy + 1].size = buffer.rows[buffer.cy].size - buffer.cx;
-        memcpy(buffer.rows[buffer.cy + 1].data, &buffer.rows[buffer.cy].data[buffer.cx], buffer.rows[buffer.cy + 1].size);
-        buffer.rows[buffer.cy].size = buffer.cx;
+    size_t i = 0;
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 64 <= length; i += 64) {
+        __m256i low = _mm256_loadu_si256((const __m256i *)&data[i]);
+        __m256i high = _mm256_loadu_si256((const __m256i *)&data[i + 32]);
+        unsigned long long mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline))
+            | (unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+        EMIT_NEWLINES(mask, i);
+    }
 
-        write_string("\x1b[0J");
+    return scan_tail(data, length, i, starts, count, max);
+}
+#elif defined(__ARM_NEON)
+size_t scan_line_starts_neon(const char *data, size_t length, size_t *starts, size_t max) {
+    size_t count = 0;
+    if (max == 0) return 0;
 
-        for (int i = buffer.cy + 1; i < buffer.n_rows; i++) {
-            write_string("\r\n");
-            write_row(&buffer.rows[i]);
+    size_t i = 0;
+    uint8x16_t newline = vdupq_n_u8('\n');
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t matches = vceqq_u8(vld1q_u8((const uint8_t *)&data[i]), newline);
+        // Narrow each byte of the comparison to a nibble so one 64-bit lane holds the mask
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        unsigned long long mask = nibbles & 0x8888888888888888ull;
+        while (mask != 0) {
+            starts[count++] = i + __builtin_ctzll(mask) / 4 + 1;
+            if (count == max) return count;
+            mask &= mask - 1;
         }
+    }
 
-        buffer.cx = 0;
-        buffer.cy++;
+    return scan_tail(data, length, i, starts, count, max);
+}
+#endif
 
-        set_row(buffer.cy + 1);
-        set_column(buffer.cx + 1);
-    } else if (c == KEY_BACKSPACE) {
-        if (buffer.cx == 0 && buffer.cy == 0) return;
-        if (buffer.cx == 0) {
-            concat_row(&buffer.rows[buffer.cy-1], &buffer.rows[buffer.cy]);
-            remove_row(buffer.cy);
-            buffer.cy--;
-            buffer.cx = buffer.rows[buffer.cy].size;
-
-            write_string("\x1b[1F");
-            write_string("\x1b[0K");
-            write_string(buffer.rows[buffer.cy].data);
-            write_string("\x1b[0J");
-
-            for (int i = buffer.cy + 2; i < buffer.n_rows; i++) {
-                write_string("\r\n");
-                write_row(&buffer.rows[i]);
-            }
+// Each of these returns how many bytes at the start of data are ASCII, which
+// lets rows and text without multibyte characters skip decoding altogether
+
+size_t ascii_prefix_scalar(const char *data, size_t length) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, &data[i], 8);
+        if (word & 0x8080808080808080ull) break;
+    }
+    while (i < length && (unsigned char)data[i] < 0x80) i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t ascii_prefix_sse2(const char *data, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&data[i]));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + ascii_prefix_scalar(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+size_t ascii_prefix_avx2(const char *data, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)&data[i]));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + ascii_prefix_scalar(&data[i], length - i);
+}
+#elif defined(__ARM_NEON)
+size_t ascii_prefix_neon(const char *data, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t high = vcgeq_u8(vld1q_u8((const uint8_t *)&data[i]), vdupq_n_u8(0x80));
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(high), 4)), 0);
+        if (nibbles != 0) return i + __builtin_ctzll(nibbles) / 4;
+    }
+    return i + ascii_prefix_scalar(&data[i], length - i);
+}
+#endif
+
+size_t (*scan_line_starts)(const char *, size_t, size_t *, size_t) = scan_line_starts_scalar;
+size_t (*ascii_prefix)(const char *, size_t) = ascii_prefix_scalar;
+
+void init_scanner() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_line_starts = scan_line_starts_avx2;
+        ascii_prefix = ascii_prefix_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_line_starts = scan_line_starts_sse2;
+        ascii_prefix = ascii_prefix_sse2;
+    }
+#elif defined(__ARM_NEON)
+    scan_line_starts = scan_line_starts_neon;
+    ascii_prefix = ascii_prefix_neon;
+#endif
+}
+
+/* Unicode */
+
+// Rows hold UTF-8. A malformed byte is shown as U+FFFD on its own and the
+// cursor steps over it like any other character
+#define REPLACEMENT_CHARACTER 0xfffd
+
+struct range {
+    uint32_t first;
+    uint32_t last;
+};
+
+// Combining marks and other characters that take up no room of their own
+const struct range zero_width[] = {
+    { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x0610, 0x061a },
+    { 0x064b, 0x065f }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a }, { 0x1ab0, 0x1aff },
+    { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x20d0, 0x20ff },
+    { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef },
+};
 
-            set_row(buffer.cy + 1);
-            set_column(buffer.cx + 1);
+// East Asian wide and fullwidth characters, and emoji, take up two columns
+const struct range double_width[] = {
+    { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+    { 0x2e80, 0x303e }, { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff },
+    { 0xa000, 0xa4cf }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe30, 0xfe4f },
+    { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f }, { 0x1f900, 0x1f9ff },
+    { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+bool in_ranges(const struct range *ranges, size_t count, uint32_t code) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (code < ranges[middle].first) {
+            high = middle;
+        } else if (code > ranges[middle].last) {
+            low = middle + 1;
         } else {
-            remove_char(&buffer.rows[buffer.cy], buffer.cx);
-            buffer.cx--;
-
-            write_string("\b");
-            write_string("\x1b[0K");
-            write(STDOUT_FILENO, &buffer.rows[buffer.cy] + buffer.cx, buffer.rows[buffer.cy].size - buffer.cx);
-        }
-    } else if (c == '\x1b') {
-        if (read_key_press() == '[') {
-            char arrow = read_key_press();
-            if (arrow == 'D') {                 // Left
-                if (buffer.cx > 0) {
-                    buffer.cx--;
-                    write_string("\x1b[D");
-                }
-            } else if (arrow == 'C') {          // Right
-                if (buffer.cx < buffer.rows[buffer.cy].size) {
-                    buffer.cx++;
-                    write_string("\x1b[C");
-                }
-            } else if (arrow == 'A') {          // Up
-                if (buffer.cy > 0) {
-                    buffer.cy--;
-                    write_string("\x1b[A");
-                }
-            } else if (arrow == 'B') {          // Down
-                if (buffer.cy < buffer.n_rows - 1) {
-                    buffer.cy++;
-                    write_string("\x1b[B");
-
-                    if (buffer.cx >= buffer.rows[buffer.cy].size) {
-                        buffer.cx = buffer.rows[buffer.cy].size - 1;
-                    }
-                }
-            }
+            return true;
         }
-    } else if (isprint(c)) {
-        write_char(c);
-
-        insert_char(&buffer.rows[buffer.cy], buffer.cx, c);
-        buffer.cx++;
     }
+    return false;
 }
 
-/* Main */
+int char_width(uint32_t code) {
+    if (code < 0x300) return 1;
+    if (in_ranges(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), code)) return 0;
+    if (in_ranges(double_width, sizeof(double_width) / sizeof(double_width[0]), code)) return 2;
+    return 1;
+}
 
-int main() {
-    enable_raw_mode();
-    clear_screen();
+// Decodes the character at the start of bytes and returns how many bytes it
+// takes up. Anything malformed decodes as U+FFFD one byte at a time
+size_t decode_utf8(const unsigned char *bytes, size_t length, uint32_t *code) {
+    unsigned char c = bytes[0];
+    *code = REPLACEMENT_CHARACTER;
+    if (c < 0x80) {
+        *code = c;
+        return 1;
+    }
 
-    init_buffer();
+    size_t size;
+    uint32_t value;
+    uint32_t min;
+    if (c >= 0xc2 && c <= 0xdf) {
+        size = 2;
+        value = c & 0x1f;
+        min = 0x80;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        size = 3;
+        value = c & 0x0f;
+        min = 0x800;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        size = 4;
+        value = c & 0x07;
+        min = 0x10000;
+    } else {
+        return 1;
+    }
 
-    while(1) {
-        handle_key_press();
+    if (length < size) return 1;
+    for (size_t i = 1; i < size; i++) {
+        if ((bytes[i] & 0xc0) != 0x80) return 1;
+        value = value << 6 | (bytes[i] & 0x3f);
     }
+    if (value < min || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff)) return 1;
 
-    return 0;
+    *code = value;
+    return size;
+}
+
+// Finds how many bytes of text fit in columns, and how many columns they take up
+size_t fit_text(const char *text, size_t length, size_t columns, size_t *width) {
+    size_t i = ascii_prefix(text, length);
+    if (i > columns) i = columns;
+    *width = i;
+
+    while (i < length) {
+        uint32_t code;
+        size_t size = decode_utf8((const unsigned char *)&text[i], length - i, &code);
+        if (*width + char_width(code) > columns) break;
+        *width += char_width(code);
+        i += size;
+    }
+    return i;
+}
+
+/* Memory */
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define SPARE_BLOCKS 64             // Blocks kept for reuse, past which closing gives them back
+
+// Powers of two and the halfway points between them, so no chunk wastes more than a third
+const size_t class_sizes[N_SIZE_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+    4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, 65536,
+};
+
+// Blocks given back by closed arenas, ready for reuse
+struct block *spare_blocks;
+size_t n_spare_blocks;
+
+int size_class(size_t size) {
+    int class = 0;
+    while (class < N_SIZE_CLASSES && class_sizes[class] < size) class++;
+    return class;
+}
+
+// How many bytes an allocation of size really gets
+size_t arena_round(size_t size) {
+    int class = size_class(size);
+    return class < N_SIZE_CLASSES ? class_sizes[class] : size;
+}
+
+void count_alloc(struct arena *arena, size_t size) {
+    arena->stats.allocs++;
+    arena->stats.in_use += size;
+    if (arena->stats.in_use > arena->stats.peak_in_use) arena->stats.peak_in_use = arena->stats.in_use;
 }
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    int class = size_class(size);
+
+    if (class == N_SIZE_CLASSES) {
+        struct large *large = malloc(sizeof(struct large) + size);
+        if (large == NULL) die("arena_alloc");
+
+        large->prev = NULL;
+        large->next = arena->large;
+        large->size = size;
+        if (arena->large != NULL) arena->large->prev = large;
+        arena->large = large;
+
+        arena->stats.large++;
+        count_alloc(arena, size);
+        return large->data;
+    }
+
+    size = class_sizes[class];
+    arena->stats.class_allocs[class]++;
+    arena->stats.class_in_use[class]++;
+    count_alloc(arena, size);
+
+    void *chunk = arena->free_lists[class];
+    if (chunk != NULL) {
+        arena->free_lists[class] = *(void **)chunk;
+        return chunk;
+    }
+
+    struct block *block = arena->blocks;
+    if (block == NULL || block->used + size > ARENA_BLOCK_SIZE) {
+        if (spare_blocks != NULL) {
+            block = spare_blocks;
+            spare_blocks = block->next;
+            n_spare_blocks--;
+        } else {
+            // Mapped rather than malloced, so that unmapping one really returns it
+            block = mmap(NULL, sizeof(struct block) + ARENA_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED) die("arena_alloc");
+        }
+
+        block->next = arena->blocks;
+        block->used = 0;
+        if (arena->blocks == NULL) arena->last_block = block;
+        arena->blocks = block;
+        arena->stats.blocks++;
+    }
+
+    chunk = &block->data[block->used];
+    block->used += size;
+    return chunk;
+}
+
+// Size must be what was passed to arena_alloc, or anything that rounds to the same class
+void arena_free(struct arena *arena, void *chunk, size_t size) {
+    if (chunk == NULL) return;
+
+    arena->stats.frees++;
+    int class = size_class(size);
+
+    if (class == N_SIZE_CLASSES) {
+        struct large *large = (struct large *)((char *)chunk - offsetof(struct large, data));
+        if (large->prev != NULL) large->prev->next = large->next;
+        else arena->large = large->next;
+        if (large->next != NULL) large->next->prev = large->prev;
+
+        arena->stats.large--;
+        arena->stats.in_use -= large->size;
+        free(large);
+        return;
+    }
+
+    arena->stats.class_in_use[class]--;
+    arena->stats.in_use -= class_sizes[class];
+    *(void **)chunk = arena->free_lists[class];
+    arena->free_lists[class] = chunk;
+}
+
+void init_arena(struct arena *arena) {
+    memset(arena, 0, sizeof(struct arena));
+}
+
+// Frees everything in the arena. The blocks are spliced onto the spare list
+// whole, so only allocations too big for a size class are freed one by one.
+// Blocks that would take the spare list past SPARE_BLOCKS are unmapped instead
+void release_arena(struct arena *arena) {
+    if (n_spare_blocks + arena->stats.blocks <= SPARE_BLOCKS) {
+        if (arena->blocks != NULL) {
+            arena->last_block->next = spare_blocks;
+            spare_blocks = arena->blocks;
+        }
+        n_spare_blocks += arena->stats.blocks;
+    } else {
+        while (arena->blocks != NULL) {
+            struct block *next = arena->blocks->next;
+            if (n_spare_blocks < SPARE_BLOCKS) {
+                arena->blocks->next = spare_blocks;
+                spare_blocks = arena->blocks;
+                n_spare_blocks++;
+            } else {
+                munmap(arena->blocks, sizeof(struct block) + ARENA_BLOCK_SIZE);
+            }
+            arena->blocks = next;
+        }
+    }
+
+    while (arena->large != NULL) {
+        struct large *next = arena->large->next;
+        free(arena->large);
+        arena->large = next;
+    }
+
+    init_arena(arena);
+}
+
+void dump_alloc_stats(FILE *file, struct arena *arena) {
+    struct alloc_stats *stats = &arena->stats;
+
+    fprintf(file, "allocs %zu  frees %zu  in use %zu bytes  peak %zu bytes\n",
+            stats->allocs, stats->frees, stats->in_use, stats->peak_in_use);
+    fprintf(file, "blocks %zu (%zu bytes)  large allocations %zu\n",
+            stats->blocks, stats->blocks * (size_t)ARENA_BLOCK_SIZE, stats->large);
+
+    for (int class = 0; class < N_SIZE_CLASSES; class++) {
+        if (stats->class_allocs[class] == 0) continue;
+        fprintf(file, "  %6zu bytes: %10zu allocs %10zu in use\n",
+                class_sizes[class], stats->class_allocs[class], stats->class_in_use[class]);
+    }
+}
+
+/* Buffer manipulation */
+
+#define ROW_MIN_CAPACITY 16
+
+#define TEXT_UNKNOWN 0
+#define TEXT_ASCII 1
+#define TEXT_UNICODE 2
+
+#define COLUMN_STRIDE 128
+
+void init_row(struct row *row) {
+    row->size = 0;
+    row->capacity = 0;
+    row->gap = 0;
+    row->data = NULL;
+    row->borrowed = false;
+    row->storage = NULL;
+    row->hl_start = 0;
+    row->hl_end = 0;
+    row->hl_dirty = true;
+    row->text = TEXT_UNKNOWN;
+    row->columns = NULL;
+    row->wraps = NULL;
+}
+
+size_t gap_size(struct row *row) {
+    return row->capacity - row->size;
+}
+
+// Index in data of the first byte after the gap
+size_t gap_end(struct row *row) {
+    return row->gap + gap_size(row);
+}
+
+void reserve_row(struct row *row, size_t extra);
+
+void release_storage(struct row *row) {
+    struct storage *storage = row->storage;
+    if (storage != NULL && --storage->refs == 0) arena_free(&buffer->arena, storage, sizeof(struct storage) + storage->size);
+    row->storage = NULL;
+}
+
+void move_gap(struct row *row, size_t index) {
+    if (row->borrowed) reserve_row(row, 0);
+
+    if (index < row->gap) {
+        memmove(&row->data[index + gap_size(row)], &row->data[index], row->gap - index);
+    } else if (index > row->gap) {
+        memmove(&row->data[row->gap], &row->data[gap_end(row)], index - row->gap);
+    }
+    row->gap = index;
+}
+
+// Makes sure the gap can hold at least `extra` more bytes, growing geometrically
+void reserve_row(struct row *row, size_t extra) {
+    if (gap_size(row) >= extra && !row->borrowed) return;
+
+    size_t capacity = row->capacity * 2;
+    if (capacity < row->size + extra) capacity = row->size + extra;
+    if (capacity < ROW_MIN_CAPACITY) capacity = ROW_MIN_CAPACITY;
+    capacity = arena_round(sizeof(struct storage) + capacity) - sizeof(struct storage);
+
+    struct storage *storage = arena_alloc(&buffer->arena, sizeof(struct storage) + capacity);
+    storage->refs = 1;
+    storage->size = capacity;
+    char *data = storage->data;
+
+    size_t tail = row->size - row->gap;
+    if (row->data != NULL) {
+        memcpy(data, row->data, row->gap);
+        memcpy(&data[capacity - tail], &row->data[gap_end(row)], tail);
+    }
+    release_storage(row);
+
+    row->data = data;
+    row->capacity = capacity;
+    row->borrowed = false;
+    row->storage = storage;
+}
+
+// Points row at bytes owned by someone else; it is copied out on its first edit
+void borrow_row(struct row *row, const char *data, size_t length) {
+    row->data = (char *)data;
+    row->size = length;
+    row->capacity = length;
+    row->gap = length;
+    row->borrowed = true;
+}
+
+void forget_columns(struct row *row);
+
+void free_row(struct row *row) {
+    forget_columns(row);
+    release_storage(row);
+    init_row(row);
+}
+
+void insert_char(struct row *row, int index, char c) {
+    reserve_row(row, 1);
+    move_gap(row, index);
+    row->data[row->gap++] = c;
+    row->size++;
+}
+
+void insert_bytes(struct row *row, size_t index, const char *bytes, size_t length) {
+    // Empty rows have no data, and memcpy wants a pointer even for no bytes
+    if (length == 0) return;
+    reserve_row(row, length);
+    move_gap(row, index);
+    memcpy(&row->data[row->gap], bytes, length);
+    row->gap += length;
+    row->size += length;
+}
+
+char row_char(struct row *row, size_t index) {
+    return index < row->gap ? row->data[index] : row->data[index + gap_size(row)];
+}
+
+void remove_char(struct row *row, int index) {
+    move_gap(row, index + 1);
+    row->gap--;
+    row->size--;
+}
+
+void remove_bytes(struct row *row, size_t index, size_t length) {
+    move_gap(row, index + length);
+    row->gap -= length;
+    row->size -= length;
+}
+
+// Moves the bytes of src from index on into dest, which has to be empty.
+// Nothing is copied: dest becomes a view of the same bytes, and it gets the
+// gap, since that is where typing carries on after Enter
+void split_row(struct row *dest, struct row *src, size_t index) {
+    if (src->borrowed) {
+        borrow_row(dest, &src->data[index], src->size - index);
+        borrow_row(src, src->data, index);
+        return;
+    }
+    if (src->storage == NULL) return;
+
+    move_gap(src, index);
+    dest->data = &src->data[index];
+    dest->capacity = src->capacity - index;
+    dest->size = src->size - index;
+    dest->gap = 0;
+    dest->borrowed = false;
+    dest->storage = src->storage;
+    dest->storage->refs++;
+
+    src->capacity = index;
+    src->size = index;
+}
+
+// Appends src to dest and leaves src empty. Views that still sit next to each
+// other, as split_row leaves them, are joined back up without copying, and
+// otherwise only the shorter of the two is copied
+void concat_row(struct row *dest, struct row *src) {
+    if (dest->borrowed && src->borrowed && dest->data + dest->size == src->data) {
+        borrow_row(dest, dest->data, dest->size + src->size);
+        init_row(src);
+        return;
+    }
+
+    if (!dest->borrowed && !src->borrowed && dest->storage != NULL && dest->storage == src->storage
+        && dest->data + dest->capacity == src->data) {
+        // Both gaps are moved to the seam, where they become one
+        move_gap(dest, dest->size);
+        move_gap(src, 0);
+        dest->capacity += src->capacity;
+        dest->size += src->size;
+        dest->storage->refs--;
+        init_row(src);
+        return;
+    }
+
+    if (src->size <= dest->size) {
+        insert_bytes(dest, dest->size, src->data, src->gap);
+        insert_bytes(dest, dest->size, &src->data[gap_end(src)], src->size - src->gap);
+        free_row(src);
+        return;
+    }
+
+    // dest is the shorter one, so it goes in front of src and the rows trade places
+    insert_bytes(src, 0, &dest->data[gap_end(dest)], dest->size - dest->gap);
+    insert_bytes(src, 0, dest->data, dest->gap);
+    struct row joined = *src;
+    joined.hl_start = dest->hl_start;
+    *src = *dest;
+    *dest = joined;
+    free_row(src);
+}
+
+// Copies up to length bytes of row starting at index into dest, returning how many were copied
+size_t copy_row(struct row *row, size_t index, char *dest, size_t length) {
+    if (index >= row->size) return 0;
+    if (length > row->size - index) length = row->size - index;
+
+    size_t copied = 0;
+    if (index < row->gap && length > 0) {
+        copied = row->gap - index < length ? row->gap - index : length;
+        memcpy(dest, &row->data[index], copied);
+        index += copied;
+    }
+    if (length > copied) memcpy(&dest[copied], &row->data[gap_end(row) + index - row->gap], length - copied);
+    return length;
+}
+
+size_t columns_size(size_t capacity) {
+    return sizeof(struct columns) + capacity * sizeof(struct checkpoint);
+}
+
+size_t wraps_size(size_t capacity) {
+    return sizeof(struct wraps) + capacity * sizeof(size_t);
+}
+
+// Drops what is known about the characters of row, which is about to change
+void forget_columns(struct row *row) {
+    if (row->columns != NULL) arena_free(&buffer->arena, row->columns, columns_size(row->columns->capacity));
+    if (row->wraps != NULL) arena_free(&buffer->arena, row->wraps, wraps_size(row->wraps->capacity));
+    row->columns = NULL;
+    row->wraps = NULL;
+    row->text = TEXT_UNKNOWN;
+}
+
+// Decodes the character at byte index of row
+size_t row_decode(struct row *row, size_t index, uint32_t *code) {
+    if (index + 4 <= row->gap) return decode_utf8((unsigned char *)&row->data[index], 4, code);
+
+    unsigned char bytes[4];
+    size_t length = 0;
+    while (length < 4 && index + length < row->size) {
+        bytes[length] = row_char(row, index + length);
+        length++;
+    }
+    return decode_utf8(bytes, length, code);
+}
+
+bool row_is_ascii(struct row *row) {
+    if (row->text == TEXT_UNKNOWN) {
+        size_t tail = row->size - row->gap;
+        bool ascii = ascii_prefix(row->data, row->gap) == row->gap
+            && ascii_prefix(&row->data[gap_end(row)], tail) == tail;
+        row->text = ascii ? TEXT_ASCII : TEXT_UNICODE;
+    }
+    return row->text == TEXT_ASCII;
+}
+
+void build_columns(struct row *row) {
+    size_t capacity = row->size / COLUMN_STRIDE + 1;
+    struct columns *columns = arena_alloc(&buffer->arena, columns_size(capacity));
+    columns->capacity = capacity;
+    columns->count = 0;
+
+    size_t column = 0;
+    for (size_t i = 0; i < row->size; ) {
+        if (i >= columns->count * COLUMN_STRIDE) {
+            columns->points[columns->count++] = (struct checkpoint){ .byte = i, .column = column };
+        }
+        uint32_t code;
+        i += row_decode(row, i, &code);
+        column += char_width(code);
+    }
+    row->columns = columns;
+}
+
+// Finds the last checkpoint at or before byte index, or display column index
+struct checkpoint find_checkpoint(struct row *row, size_t index, bool by_column) {
+    struct checkpoint start = { .byte = 0, .column = 0 };
+    if (row->size <= COLUMN_STRIDE) return start;
+    if (row->columns == NULL) build_columns(row);
+
+    struct checkpoint *points = row->columns->points;
+    size_t low = 0;
+    size_t high = row->columns->count;
+    while (low + 1 < high) {
+        size_t middle = (low + high) / 2;
+        if ((by_column ? points[middle].column : points[middle].byte) <= index) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return row->columns->count > 0 ? points[low] : start;
+}
+
+// Display column that byte index of row starts at
+size_t column_of(struct row *row, size_t index) {
+    if (row_is_ascii(row)) return index;
+
+    struct checkpoint point = find_checkpoint(row, index, false);
+    size_t column = point.column;
+    for (size_t i = point.byte; i < index; ) {
+        uint32_t code;
+        i += row_decode(row, i, &code);
+        column += char_width(code);
+    }
+    return column;
+}
+
+// Byte of row where the character covering display column starts, or the end of
+// the row if it is not that wide. *start gets the column that character starts at
+size_t byte_at_column(struct row *row, size_t column, size_t *start) {
+    if (row_is_ascii(row)) {
+        *start = column < row->size ? column : row->size;
+        return *start;
+    }
+
+    struct checkpoint point = find_checkpoint(row, column, true);
+    size_t i = point.byte;
+    *start = point.column;
+    while (i < row->size) {
+        uint32_t code;
+        size_t size = row_decode(row, i, &code);
+        if (*start + char_width(code) > column) break;
+        *start += char_width(code);
+        i += size;
+    }
+    return i;
+}
+
+// Breaks row into visual lines at most width columns wide, after the last
+// space that fits where there is one. The breaks are kept until the row is
+// edited or they are asked for at another width
+struct wraps *row_wraps(struct row *row, int width) {
+    if (row->wraps != NULL && row->wraps->width == width) return row->wraps;
+    if (row->wraps != NULL) arena_free(&buffer->arena, row->wraps, wraps_size(row->wraps->capacity));
+
+    static size_t *starts = NULL;
+    static size_t capacity = 0;
+    size_t count = 0;
+
+    size_t line = 0;
+    size_t column = 0;
+    size_t space = 0;           // Just after the last space on the line, if not 0
+    size_t space_column = 0;
+    for (size_t i = 0; i < row->size; ) {
+        uint32_t code;
+        size_t size = row_decode(row, i, &code);
+        size_t char_columns = char_width(code);
+
+        // Breaking after a space can leave too little room for a wide character, hence a loop
+        while (column + char_columns > (size_t)width && i > line) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                starts = realloc(starts, capacity * sizeof(size_t));
+                if (starts == NULL) die("row_wraps");
+            }
+            if (space > line) {
+                line = space;
+                column -= space_column;
+            } else {
+                line = i;
+                column = 0;
+            }
+            starts[count++] = line;
+            space = 0;
+        }
+
+        column += char_columns;
+        if (code == ' ') {
+            space = i + size;
+            space_column = column;
+        }
+        i += size;
+    }
+
+    struct wraps *wraps = arena_alloc(&buffer->arena, wraps_size(count));
+    wraps->capacity = count;
+    wraps->count = count;
+    wraps->width = width;
+    if (count > 0) memcpy(wraps->starts, starts, count * sizeof(size_t));
+    row->wraps = wraps;
+    return wraps;
+}
+
+size_t next_char(struct row *row, size_t index) {
+    uint32_t code;
+    return index + row_decode(row, index, &code);
+}
+
+size_t previous_char(struct row *row, size_t index) {
+    size_t start = index - 1;
+    while (start > 0 && index - start < 4 && (row_char(row, start) & 0xc0) == 0x80) start--;
+    return next_char(row, start) == index ? start : index - 1;
+}
+
+/* Document */
+
+struct node *new_node(bool leaf) {
+    struct node *node = arena_alloc(&buffer->arena, sizeof(struct node));
+
+    node->leaf = leaf;
+    node->dirty = true;
+    node->bytes_stale = true;
+    node->count = 0;
+    node->n_rows = 0;
+    node->bloom = NULL;
+    node->cache_search = 0;
+    return node;
+}
+
+void free_node(struct node *node) {
+    if (node->bloom != NULL) arena_free(&buffer->arena, node->bloom, BLOOM_BITS / 8);
+    arena_free(&buffer->arena, node, sizeof(struct node));
+}
+
+int node_capacity(struct node *node) {
+    return node->leaf ? LEAF_ROWS : NODE_CHILDREN;
+}
+
+size_t item_size(struct node *node) {
+    return node->leaf ? sizeof(struct row) : sizeof(struct node *);
+}
+
+char *node_item(struct node *node, int index) {
+    char *items = node->leaf ? (char *)node->rows : (char *)node->children;
+    return items + index * item_size(node);
+}
+
+void count_rows(struct node *node) {
+    node->bytes_stale = true;
+    if (node->leaf) {
+        node->n_rows = node->count;
+        return;
+    }
+
+    node->n_rows = 0;
+    for (int i = 0; i < node->count; i++) {
+        node->n_rows += node->children[i]->n_rows;
+    }
+}
+
+// Moves the last `count` items of src to the front of dest
+void shift_items_right(struct node *src, struct node *dest, int count) {
+    memmove(node_item(dest, count), node_item(dest, 0), dest->count * item_size(dest));
+    memcpy(node_item(dest, 0), node_item(src, src->count - count), count * item_size(src));
+    src->count -= count;
+    dest->count += count;
+    src->dirty = dest->dirty = true;
+    count_rows(src);
+    count_rows(dest);
+}
+
+// Moves the first `count` items of src to the back of dest
+void shift_items_left(struct node *src, struct node *dest, int count) {
+    memcpy(node_item(dest, dest->count), node_item(src, 0), count * item_size(src));
+    memmove(node_item(src, 0), node_item(src, count), (src->count - count) * item_size(src));
+    src->count -= count;
+    dest->count += count;
+    src->dirty = dest->dirty = true;
+    count_rows(src);
+    count_rows(dest);
+}
+
+// Finds the child containing row *index and makes *index relative to it
+int find_child(struct node *node, size_t *index) {
+    int i = 0;
+    while (i < node->count - 1 && *index >= node->children[i]->n_rows) {
+        *index -= node->children[i]->n_rows;
+        i++;
+    }
+    return i;
+}
+
+// Adds up the bytes below node again if they changed, which after an edit is
+// only along the path down to the edited row
+size_t node_bytes(struct node *node) {
+    if (!node->bytes_stale) return node->n_bytes;
+
+    size_t bytes = 0;
+    for (int i = 0; i < node->count; i++) {
+        bytes += node->leaf ? node->rows[i].size + 1 : node_bytes(node->children[i]);
+    }
+    node->n_bytes = bytes;
+    node->bytes_stale = false;
+    return bytes;
+}
+
+// Finds the row that byte *offset of the document is in, and makes *offset
+// relative to the start of that row. Offsets past the end are in the last row
+size_t row_at_offset(size_t *offset) {
+    struct node *node = buffer->root;
+    size_t y = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->count - 1 && *offset >= node_bytes(node->children[i])) {
+            *offset -= node_bytes(node->children[i]);
+            y += node->children[i]->n_rows;
+            i++;
+        }
+        node = node->children[i];
+    }
+
+    int i = 0;
+    while (i < node->count - 1 && *offset > node->rows[i].size) {
+        *offset -= node->rows[i].size + 1;
+        i++;
+    }
+    return y + i;
+}
+
+size_t row_count() {
+    return buffer->root->n_rows;
+}
+
+struct row *get_row(size_t index) {
+    struct node *node = buffer->root;
+    while (!node->leaf) {
+        node = node->children[find_child(node, &index)];
+    }
+    return &node->rows[index];
+}
+
+// Like get_row, for callers about to change the row, so that searches know to look at it again
+struct row *modify_row(size_t index) {
+    struct node *node = buffer->root;
+    while (!node->leaf) {
+        node->bytes_stale = true;
+        node = node->children[find_child(node, &index)];
+    }
+    node->bytes_stale = true;
+    node->dirty = true;
+    node->rows[index].hl_dirty = true;
+    forget_columns(&node->rows[index]);
+    if (buffer->highlighted > index) buffer->highlighted = index;
+    return &node->rows[index];
+}
+
+// Inserts an empty row at index and returns the new right half if node had to split
+struct node *node_insert(struct node *node, size_t index) {
+    struct node *sibling = NULL;
+
+    if (node->leaf) {
+        if (node->count == LEAF_ROWS) {
+            // Inserting near the end only moves what follows, so rows that are
+            // loaded or pasted in sequence pack leaves densely
+            sibling = new_node(true);
+            shift_items_right(node, sibling, index >= LEAF_ROWS * 3 / 4 ? LEAF_ROWS - index : LEAF_ROWS / 2);
+            if (index >= node->count) {
+                index -= node->count;
+                node = sibling;
+            }
+        }
+
+        memmove(&node->rows[index + 1], &node->rows[index], (node->count - index) * sizeof(struct row));
+        init_row(&node->rows[index]);
+        node->count++;
+        node->dirty = true;
+        node->bytes_stale = true;
+        node->n_rows++;
+        return sibling;
+    }
+
+    int i = find_child(node, &index);
+    struct node *split = node_insert(node->children[i], index);
+    node->n_rows++;
+    node->bytes_stale = true;
+    if (split == NULL) return NULL;
+
+    if (node->count == NODE_CHILDREN) {
+        sibling = new_node(false);
+        shift_items_right(node, sibling, i + 1 >= NODE_CHILDREN * 3 / 4 ? NODE_CHILDREN - i - 1 : NODE_CHILDREN / 2);
+        if (i + 1 >= node->count) {
+            i -= node->count;
+            node = sibling;
+        }
+    }
+
+    memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i - 1) * sizeof(struct node *));
+    node->children[i + 1] = split;
+    node->count++;
+    count_rows(node);
+    return sibling;
+}
+
+// Merges or evens out an underfull child with one of its neighbours
+void rebalance_child(struct node *node, int i) {
+    struct node *child = node->children[i];
+    if (child->count >= node_capacity(child) / 4 || node->count < 2) return;
+
+    if (i == node->count - 1) i--;
+    struct node *left = node->children[i];
+    struct node *right = node->children[i + 1];
+
+    if (left->count + right->count <= node_capacity(left)) {
+        shift_items_left(right, left, right->count);
+        free_node(right);
+        memmove(&node->children[i + 1], &node->children[i + 2], (node->count - i - 2) * sizeof(struct node *));
+        node->count--;
+    } else if (left->count > right->count) {
+        shift_items_right(left, right, (left->count - right->count) / 2);
+    } else {
+        shift_items_left(right, left, (right->count - left->count) / 2);
+    }
+}
+
+void node_remove(struct node *node, size_t index) {
+    if (node->leaf) {
+        free_row(&node->rows[index]);
+        memmove(&node->rows[index], &node->rows[index + 1], (node->count - index - 1) * sizeof(struct row));
+        node->count--;
+        node->n_rows--;
+        node->dirty = true;
+        node->bytes_stale = true;
+        return;
+    }
+
+    int i = find_child(node, &index);
+    node_remove(node->children[i], index);
+    node->n_rows--;
+    node->bytes_stale = true;
+    rebalance_child(node, i);
+}
+
+struct row *insert_row(size_t index) {
+    if (buffer->highlighted > index) buffer->highlighted = index;
+    struct node *split = node_insert(buffer->root, index);
+    if (split != NULL) {
+        struct node *root = new_node(false);
+        root->children[0] = buffer->root;
+        root->children[1] = split;
+        root->count = 2;
+        count_rows(root);
+        buffer->root = root;
+    }
+    return get_row(index);
+}
+
+void remove_row(size_t index) {
+    if (buffer->highlighted > index) buffer->highlighted = index;
+    node_remove(buffer->root, index);
+    if (!buffer->root->leaf && buffer->root->count == 1) {
+        struct node *root = buffer->root->children[0];
+        free_node(buffer->root);
+        buffer->root = root;
+    }
+}
+
+// Breaks row y in two at byte x, moving the tail onto a new row below
+void split_line(size_t y, size_t x) {
+    struct row *tail = insert_row(y + 1);
+    split_row(tail, modify_row(y), x);
+}
+
+// Appends row y to the end of row y - 1 and removes it
+void join_lines(size_t y) {
+    struct row *row = modify_row(y);
+    concat_row(modify_row(y - 1), row);
+    remove_row(y);
+}
+
+// Inserts size bytes of block at (*y, *x) in a single pass and leaves (*y, *x)
+// just after them. Lines after the first borrow their bytes from block, which
+// has to live as long as the buffer does, like the file mapping
+void insert_block(size_t *y, size_t *x, const char *block, size_t size) {
+    size_t starts[INDEX_CHUNK_ROWS];
+    size_t line = 0;
+    size_t found;
+    while ((found = scan_line_starts(&block[line], size - line, starts, INDEX_CHUNK_ROWS)) > 0) {
+        size_t offset = line;
+        for (size_t i = 0; i < found; i++) {
+            size_t next = offset + starts[i];
+            if (line == 0) {
+                // Inserted before splitting, so that both go where the gap already is
+                insert_bytes(modify_row(*y), *x, block, next - 1);
+                split_line(*y, *x + next - 1);
+            } else {
+                borrow_row(insert_row(*y), &block[line], next - line - 1);
+            }
+            (*y)++;
+            line = next;
+        }
+    }
+
+    if (line == 0) {
+        insert_bytes(modify_row(*y), *x, block, size);
+        *x += size;
+        return;
+    }
+
+    insert_bytes(modify_row(*y), 0, &block[line], size - line);
+    *x = size - line;
+}
+
+// A chunk of the arena that lives as long as the buffer, for rows to borrow from
+char *new_block(size_t length) {
+    struct pasted *pasted = arena_alloc(&buffer->arena, sizeof(struct pasted) + length);
+    pasted->capacity = length;
+    pasted->next = buffer->pasted;
+    buffer->pasted = pasted;
+    return pasted->text;
+}
+
+// Copies text into a chunk of the arena with line breaks as plain newlines,
+// since terminals send pasted line breaks as carriage returns. Only for what
+// comes from the terminal; a carriage return in the journal is part of the text
+char *normalize_text(const char *text, size_t length, size_t *size) {
+    char *block = new_block(length);
+
+    *size = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '\r') {
+            block[(*size)++] = '\n';
+            if (i + 1 < length && text[i + 1] == '\n') i++;
+        } else {
+            block[(*size)++] = text[i];
+        }
+    }
+    return block;
+}
+
+// Inserts text exactly as it is, like it was when it was recorded. Only rows
+// after a line break borrow from a block; a single line is copied into its row
+void insert_copy(size_t *y, size_t *x, const char *text, size_t length) {
+    if (length == 0) return;
+    if (memchr(text, '\n', length) == NULL) {
+        insert_block(y, x, text, length);
+        return;
+    }
+
+    char *block = new_block(length);
+    memcpy(block, text, length);
+    insert_block(y, x, block, length);
+}
+
+// Removes everything from (y, x) up to (end_y, end_x)
+void delete_range(size_t y, size_t x, size_t end_y, size_t end_x) {
+    if (y == end_y) {
+        remove_bytes(modify_row(y), x, end_x - x);
+        return;
+    }
+
+    struct row *row = modify_row(y);
+    remove_bytes(row, x, row->size - x);
+    remove_bytes(modify_row(end_y), 0, end_x);
+    for (size_t i = y + 1; i < end_y; i++) {
+        remove_row(y + 1);
+    }
+    join_lines(y + 1);
+}
+
+// Finds where text ends up when it is inserted at (y, x)
+void text_end(size_t y, size_t x, const char *text, size_t length, size_t *end_y, size_t *end_x) {
+    const char *line = text;
+    const char *newline;
+    while ((newline = memchr(line, '\n', length - (line - text))) != NULL) {
+        y++;
+        x = 0;
+        line = newline + 1;
+    }
+
+    *end_y = y;
+    *end_x = x + length - (line - text);
+}
+
+void clear_journal();
+
+// Gives buffer an empty document
+void reset_buffer() {
+    clear_journal();
+    buffer->root = new_node(true);
+    insert_row(0);
+    buffer->pasted = NULL;
+
+    buffer->filename = NULL;
+    buffer->mapping = NULL;
+    buffer->map_fd = -1;
+    buffer->map = NULL;
+    buffer->map_size = 0;
+    buffer->trailing_newline = true;
+    buffer->indexed = 0;
+    buffer->highlight = false;
+    buffer->highlighted = 0;
+    buffer->follow_watch = -1;
+    buffer->followed = 0;
+    buffer->follow_block = NULL;
+    buffer->follow_used = 0;
+    buffer->swap = NULL;
+    buffer->streaming = false;
+    buffer->pinned = false;
+    buffer->window_start = 0;
+
+    buffer->cx = 0;
+    buffer->cy = 0;
+    buffer->cursors = NULL;
+    buffer->n_cursors = 0;
+    buffer->cursor_capacity = 0;
+    buffer->row_offset = 0;
+    buffer->col_offset = 0;
+    buffer->wrap_offset = 0;
+}
+
+void free_tree(struct node *node) {
+    for (int i = 0; i < node->count; i++) {
+        if (node->leaf) {
+            free_row(&node->rows[i]);
+        } else {
+            free_tree(node->children[i]);
+        }
+    }
+    free_node(node);
+}
+
+void release_mapping(struct mapping *mapping);
+void stop_following();
+void close_swap();
+
+// Drops the whole document. Its rows, nodes and pasted blocks all live in
+// its arena, so they go in one splice
+void release_buffer() {
+    stop_following();
+    close_swap();
+    clear_journal();
+    release_arena(&buffer->arena);
+    buffer->pasted = NULL;
+    if (buffer->mapping != NULL) release_mapping(buffer->mapping);
+    free(buffer->filename);
+    free(buffer->cursors);
+}
+
+// Leaves an empty buffer behind
+void close_buffer() {
+    release_buffer();
+    reset_buffer();
+}
+
+/* Undo */
+
+void before_edit();
+void log_edit(uint64_t kind, size_t y, size_t x, const char *text, size_t length);
+void replace_matches(const char *text, bool forward);
+
+// Swap records that aren't a delete (0) or an insert (1)
+#define SWAP_REPLACE 2
+#define SWAP_UNREPLACE 3
+
+#define JOURNAL_ENTRIES 4096
+#define JOURNAL_BUDGET (64 << 20)   // Bytes of text the journal may own
+
+struct edit *journal_entry(size_t index) {
+    struct journal *journal = &buffer->journal;
+    return &journal->edits[(journal->first + index) % JOURNAL_ENTRIES];
+}
+
+void free_edit(struct edit *edit) {
+    if (!edit->borrowed) {
+        free(edit->text);
+        buffer->journal.bytes -= edit->capacity;
+    }
+}
+
+// Goes a whole group at a time, so that undo never reverts part of one
+void drop_oldest_group() {
+    struct journal *journal = &buffer->journal;
+    size_t group = journal_entry(0)->group;
+
+    while (journal->count > 0 && journal_entry(0)->group == group) {
+        free_edit(journal_entry(0));
+        journal->first = (journal->first + 1) % JOURNAL_ENTRIES;
+        journal->count--;
+        journal->applied--;
+    }
+}
+
+void clear_journal() {
+    struct journal *journal = &buffer->journal;
+    if (journal->edits == NULL) {
+        journal->edits = malloc(JOURNAL_ENTRIES * sizeof(struct edit));
+        if (journal->edits == NULL) die("clear_journal");
+    }
+
+    for (size_t i = 0; i < journal->count; i++) {
+        free_edit(journal_entry(i));
+    }
+    journal->first = 0;
+    journal->count = 0;
+    journal->applied = 0;
+    journal->bytes = 0;
+    journal->mergeable = false;
+    journal->batching = false;
+}
+
+void reserve_edit(struct edit *edit, size_t length) {
+    if (edit->length + length <= edit->capacity) return;
+
+    size_t capacity = edit->capacity * 2;
+    if (capacity < edit->length + length) capacity = edit->length + length;
+
+    edit->text = realloc(edit->text, capacity);
+    if (edit->text == NULL) die("reserve_edit");
+    buffer->journal.bytes += capacity - edit->capacity;
+    edit->capacity = capacity;
+}
+
+// Typing or deleting a run of characters on one line extends the newest entry
+// instead of adding a new one, unless a batch has started a group since
+bool merge_edit(bool insert, size_t y, size_t x, const char *text, size_t length) {
+    struct journal *journal = &buffer->journal;
+    if (!journal->mergeable || journal->applied == 0) return false;
+
+    struct edit *last = journal_entry(journal->applied - 1);
+    if (last->group != journal->group) return false;
+    if (last->insert != insert || last->borrowed || last->multiline || last->replace || last->y != y) return false;
+    if (memchr(text, '\n', length) != NULL) return false;
+
+    if (insert && x == last->x + last->length) {
+        reserve_edit(last, length);
+        memcpy(&last->text[last->length], text, length);
+    } else if (!insert && x + length == last->x) {
+        // Backspace: the new text goes in front
+        reserve_edit(last, length);
+        memmove(&last->text[length], last->text, last->length);
+        memcpy(last->text, text, length);
+        last->x = x;
+    } else if (!insert && x == last->x) {
+        reserve_edit(last, length);
+        memcpy(&last->text[last->length], text, length);
+    } else {
+        return false;
+    }
+
+    last->length += length;
+    return true;
+}
+
+// Anything that could have been redone goes once a new edit is made
+void drop_redo() {
+    struct journal *journal = &buffer->journal;
+    while (journal->count > journal->applied) {
+        free_edit(journal_entry(--journal->count));
+    }
+}
+
+// Makes edit the newest entry, in a group of its own unless batching
+struct edit *push_edit(struct edit edit) {
+    struct journal *journal = &buffer->journal;
+    if (journal->count == JOURNAL_ENTRIES) drop_oldest_group();
+
+    if (!journal->batching) journal->group++;
+    edit.group = journal->group;
+    struct edit *entry = journal_entry(journal->count);
+    *entry = edit;
+    journal->bytes += edit.capacity;
+
+    journal->count++;
+    journal->applied++;
+    journal->mergeable = true;
+
+    // The newest group is always kept so that the last edit can be undone
+    while (journal->bytes > JOURNAL_BUDGET && journal_entry(0)->group != journal->group) drop_oldest_group();
+    return journal_entry(journal->count - 1);
+}
+
+// Adds an edit to the journal, throwing away anything that could have been
+// redone. With borrowed set, text belongs to the buffer's arena and is not copied
+void record_edit(bool insert, size_t y, size_t x, const char *text, size_t length, bool borrowed) {
+    buffer->pinned = true;
+    log_edit(insert, y, x, text, length);
+    drop_redo();
+
+    if (!borrowed && merge_edit(insert, y, x, text, length)) return;
+
+    struct edit edit = {
+        .insert = insert,
+        .borrowed = borrowed,
+        .multiline = memchr(text, '\n', length) != NULL,
+        .y = y,
+        .x = x,
+        .length = length,
+        .capacity = 0,
+        .text = (char *)text,
+    };
+    if (!borrowed) {
+        edit.text = malloc(length);
+        if (edit.text == NULL && length > 0) die("record_edit");
+        memcpy(edit.text, text, length);
+        edit.capacity = length;
+    }
+    push_edit(edit);
+}
+
+// Adds a replace all to the journal as one entry, which takes over text, a
+// replace_header and what follows it from malloc. It goes into the document
+// and the swap file through apply_edit like a redo, forward or back
+struct edit *record_replace(bool forward, char *text, size_t length) {
+    buffer->pinned = true;
+    drop_redo();
+
+    struct edit *edit = push_edit((struct edit){
+        .insert = forward,
+        .replace = true,
+        .length = length,
+        .capacity = length,
+        .text = text,
+    });
+    buffer->journal.mergeable = false;
+    return edit;
+}
+
+// Puts the text of edit into the document or takes it out again, leaving the
+// cursor after inserted text or where removed text used to start. A replace
+// all goes forward or back and leaves the cursor at its first match
+void apply_edit(struct edit *edit, bool insert) {
+    if (edit->replace) {
+        log_edit(insert ? SWAP_REPLACE : SWAP_UNREPLACE, 0, 0, edit->text, edit->length);
+        replace_matches(edit->text, insert);
+        return;
+    }
+
+    log_edit(insert, edit->y, edit->x, edit->text, edit->length);
+    size_t end_y, end_x;
+    text_end(edit->y, edit->x, edit->text, edit->length, &end_y, &end_x);
+
+    if (insert) {
+        size_t y = edit->y;
+        size_t x = edit->x;
+        if (edit->borrowed) {
+            insert_block(&y, &x, edit->text, edit->length);
+        } else {
+            insert_copy(&y, &x, edit->text, edit->length);
+        }
+    } else {
+        delete_range(edit->y, edit->x, end_y, end_x);
+    }
+
+    buffer->cy = insert ? end_y : edit->y;
+    buffer->cx = insert ? end_x : edit->x;
+}
+
+// Both leave a single cursor, at the last edit they went through
+void undo() {
+    struct journal *journal = &buffer->journal;
+    if (journal->applied == 0) return;
+
+    before_edit();
+    buffer->n_cursors = 0;
+    size_t group = journal_entry(journal->applied - 1)->group;
+    while (journal->applied > 0 && journal_entry(journal->applied - 1)->group == group) {
+        struct edit *edit = journal_entry(--journal->applied);
+        apply_edit(edit, !edit->insert);
+    }
+    journal->mergeable = false;
+}
+
+void redo() {
+    struct journal *journal = &buffer->journal;
+    if (journal->applied == journal->count) return;
+
+    before_edit();
+    buffer->n_cursors = 0;
+    size_t group = journal_entry(journal->applied)->group;
+    while (journal->applied < journal->count && journal_entry(journal->applied)->group == group) {
+        struct edit *edit = journal_entry(journal->applied++);
+        apply_edit(edit, edit->insert);
+    }
+    journal->mergeable = false;
+}
+
+/* Editing */
+
+// Every change that should be undoable goes through these, which record it in
+// the journal before applying it to the document
+
+void edit_insert_char(size_t y, size_t x, char c) {
+    before_edit();
+    record_edit(true, y, x, &c, 1, false);
+    insert_char(modify_row(y), x, c);
+}
+
+void edit_remove_char(size_t y, size_t x) {
+    before_edit();
+    char c = row_char(get_row(y), x);
+    record_edit(false, y, x, &c, 1, false);
+    remove_char(modify_row(y), x);
+}
+
+void edit_split_line(size_t y, size_t x) {
+    before_edit();
+    record_edit(true, y, x, "\n", 1, false);
+    split_line(y, x);
+}
+
+void edit_join_lines(size_t y) {
+    before_edit();
+    record_edit(false, y - 1, get_row(y - 1)->size, "\n", 1, false);
+    join_lines(y);
+}
+
+void edit_insert_text(size_t *y, size_t *x, const char *text, size_t length) {
+    if (length == 0) return;
+    before_edit();
+
+    size_t size;
+    char *block = normalize_text(text, length, &size);
+    record_edit(true, *y, *x, block, size, true);
+    insert_block(y, x, block, size);
+}
+
+/* Cursors */
+
+// Besides the buffer's own cursor there can be any number of others. Each
+// keystroke makes its edit at all of them at once, as one undo step
+
+bool cursor_before(struct cursor a, struct cursor b) {
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+int compare_cursors(const void *a, const void *b) {
+    const struct cursor *first = a;
+    const struct cursor *second = b;
+    if (cursor_before(*first, *second)) return -1;
+    return cursor_before(*second, *first) ? 1 : 0;
+}
+
+// Puts the extra cursors back in order after they moved, dropping any that
+// ended up on top of another cursor
+void sort_cursors() {
+    struct cursor *cursors = buffer->cursors;
+    qsort(cursors, buffer->n_cursors, sizeof(struct cursor), compare_cursors);
+
+    struct cursor own = { buffer->cy, buffer->cx };
+    size_t count = 0;
+    for (size_t i = 0; i < buffer->n_cursors; i++) {
+        if (compare_cursors(&cursors[i], &own) == 0) continue;
+        if (count > 0 && compare_cursors(&cursors[i], &cursors[count - 1]) == 0) continue;
+        cursors[count++] = cursors[i];
+    }
+    buffer->n_cursors = count;
+}
+
+// Leaves an extra cursor where the buffer's cursor is, so it can move on
+void add_cursor() {
+    if (buffer->n_cursors == buffer->cursor_capacity) {
+        size_t capacity = buffer->cursor_capacity ? buffer->cursor_capacity * 2 : 16;
+        buffer->cursors = realloc(buffer->cursors, capacity * sizeof(struct cursor));
+        if (buffer->cursors == NULL) die("add_cursor");
+        buffer->cursor_capacity = capacity;
+    }
+    buffer->cursors[buffer->n_cursors++] = (struct cursor){ buffer->cy, buffer->cx };
+}
+
+void set_message(const char *format, ...);
+
+// Removes the character before every cursor with backspace set, and then
+// inserts length bytes of text at every cursor. The edits go from the last
+// cursor to the first, so each is made where nothing before it has moved yet
+// and the positions worked out up front stay good. One pass from the top
+// then moves each cursor past its edit, by what every edit above it added
+void edit_cursors(const char *text, size_t length, bool backspace) {
+    size_t count = buffer->n_cursors + 1;
+    // Each cursor records up to two entries, a removal and an insertion, all in
+    // one group, and a group has to fit in the journal to be undone whole
+    if (count > JOURNAL_ENTRIES / 2) {
+        set_message("Can't edit at more than %d cursors at once", JOURNAL_ENTRIES / 2);
+        return;
+    }
+
+    struct cursor *ends = malloc(count * 2 * sizeof(struct cursor));
+    if (ends == NULL) die("edit_cursors");
+    struct cursor *starts = &ends[count];
+
+    // Where the buffer's own cursor goes among the others
+    struct cursor own = { buffer->cy, buffer->cx };
+    size_t mine = 0;
+    while (mine < buffer->n_cursors && cursor_before(buffer->cursors[mine], own)) mine++;
+    memcpy(ends, buffer->cursors, mine * sizeof(struct cursor));
+    ends[mine] = own;
+    memcpy(&ends[mine + 1], &buffer->cursors[mine], (buffer->n_cursors - mine) * sizeof(struct cursor));
+
+    for (size_t i = 0; i < count; i++) {
+        starts[i] = ends[i];
+        if (!backspace) continue;
+        if (ends[i].x > 0) {
+            starts[i].x = previous_char(get_row(ends[i].y), ends[i].x);
+        } else if (ends[i].y > 0) {
+            starts[i] = (struct cursor){ ends[i].y - 1, get_row(ends[i].y - 1)->size };
+        }
+    }
+
+    before_edit();
+    char *block = NULL;
+    size_t size = length;
+    if (length > 1 || (length == 1 && text[0] == '\r')) block = normalize_text(text, length, &size);
+
+    struct journal *journal = &buffer->journal;
+    journal->group++;
+    journal->batching = true;
+    for (size_t i = count; i-- > 0; ) {
+        struct cursor start = starts[i];
+        if (start.y < ends[i].y) {
+            edit_join_lines(ends[i].y);
+        } else {
+            for (size_t x = ends[i].x; x > start.x; x--) edit_remove_char(start.y, x - 1);
+        }
+
+        if (block != NULL) {
+            record_edit(true, start.y, start.x, block, size, true);
+            insert_block(&start.y, &start.x, block, size);
+        } else if (length == 1 && text[0] == '\n') {
+            edit_split_line(start.y, start.x);
+        } else if (length == 1) {
+            edit_insert_char(start.y, start.x, text[0]);
+        }
+    }
+    journal->batching = false;
+
+    // What the inserted text does to a position after it
+    const char *inserted = block != NULL ? block : text;
+    size_t lines = 0;
+    size_t tail = size;
+    for (const char *newline = inserted; size > 0 && (newline = memchr(newline, '\n', inserted + size - newline)) != NULL; newline++) {
+        lines++;
+        tail = inserted + size - newline - 1;
+    }
+
+    // Rows above the last edited one have only moved by whole rows, while
+    // the rest of the last edited row has moved on to where its cursor ended
+    size_t added = 0;
+    size_t removed = 0;
+    struct cursor last = { SIZE_MAX, 0 };
+    struct cursor moved = { 0, 0 };
+    for (size_t i = 0; i < count; i++) {
+        struct cursor at = { starts[i].y + added - removed, starts[i].x };
+        if (starts[i].y == last.y) at = (struct cursor){ moved.y, starts[i].x - last.x + moved.x };
+        moved = lines == 0 ? (struct cursor){ at.y, at.x + tail } : (struct cursor){ at.y + lines, tail };
+
+        removed += ends[i].y - starts[i].y;
+        added += lines;
+        last = ends[i];
+        ends[i] = moved;
+    }
+
+    buffer->cy = ends[mine].y;
+    buffer->cx = ends[mine].x;
+    memcpy(buffer->cursors, ends, mine * sizeof(struct cursor));
+    memcpy(&buffer->cursors[mine], &ends[mine + 1], (buffer->n_cursors - mine) * sizeof(struct cursor));
+    free(ends);
+
+    // Backspaces can bring cursors together
+    sort_cursors();
+}
+
+/* Highlighting */
+
+// C-like sources are coloured by a small lexer. Every row caches the lexer
+// state it starts and ends in, so after an edit only rows from the edited one
+// down to where the states agree with the cache again are lexed, and never
+// further down than the screen reaches
+#define HL_NORMAL 0
+#define HL_COMMENT 1            // Inside a block comment
+
+#define HL_PLAIN 0
+#define HL_KEYWORD 1
+#define HL_STRING 2
+#define HL_NUMBER 3
+#define HL_COMMENT_TEXT 4
+#define HL_PREPROCESSOR 5
+
+#define HIGHLIGHT_SLICE 4096    // Rows lexed per turn of the event loop
+
+const char *hl_colors[] = { "\x1b[0m", "\x1b[33m", "\x1b[35m", "\x1b[31m", "\x1b[36m", "\x1b[32m" };
+
+const char *hl_extensions[] = { ".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", NULL };
+
+const char *hl_keywords[] = {
+    "auto", "bool", "break", "case", "char", "const", "continue", "default", "do", "double",
+    "else", "enum", "extern", "false", "float", "for", "goto", "if", "inline", "int", "long",
+    "register", "restrict", "return", "short", "signed", "sizeof", "static", "struct",
+    "switch", "true", "typedef", "union", "unsigned", "void", "volatile", "while", "NULL", NULL
+};
+
+struct {
+    bool scheduled;
+    size_t target;              // Rows that should be up to date once it has run
+    size_t capacity;
+    char *line;                 // Contiguous copy of the row being lexed
+    unsigned char *classes;
+} highlighter;
+
+bool wants_highlight(const char *filename) {
+    const char *extension = strrchr(filename, '.');
+    if (extension == NULL) return false;
+
+    for (int i = 0; hl_extensions[i] != NULL; i++) {
+        if (strcmp(extension, hl_extensions[i]) == 0) return true;
+    }
+    return false;
+}
+
+bool is_keyword(const char *word, size_t length) {
+    for (int i = 0; hl_keywords[i] != NULL; i++) {
+        if (strlen(hl_keywords[i]) == length && memcmp(hl_keywords[i], word, length) == 0) return true;
+    }
+    return false;
+}
+
+bool is_word_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Lexes length bytes of line starting in state and returns the state it ends
+// in. If classes is not NULL it gets the highlight class of every byte
+int lex_row(const char *line, size_t length, int state, unsigned char *classes) {
+    bool indent = true;         // Nothing but whitespace so far
+    size_t i = 0;
+    while (i < length) {
+        size_t begin = i;
+        char c = line[i];
+        int class = HL_PLAIN;
+
+        if (state == HL_COMMENT) {
+            const char *end = memmem(&line[i], length - i, "*/", 2);
+            i = end == NULL ? length : (size_t)(end - line) + 2;
+            if (end != NULL) state = HL_NORMAL;
+            class = HL_COMMENT_TEXT;
+        } else if (c == '/' && i + 1 < length && line[i + 1] == '/') {
+            i = length;
+            class = HL_COMMENT_TEXT;
+        } else if (c == '/' && i + 1 < length && line[i + 1] == '*') {
+            i += 2;
+            state = HL_COMMENT;
+            class = HL_COMMENT_TEXT;
+        } else if (c == '"' || c == '\'') {
+            i++;
+            while (i < length && line[i] != c) i += line[i] == '\\' ? 2 : 1;
+            i = i < length ? i + 1 : length;
+            class = HL_STRING;
+        } else if (isdigit((unsigned char)c)) {
+            while (i < length && (is_word_char(line[i]) || line[i] == '.')) i++;
+            class = HL_NUMBER;
+        } else if (is_word_char(c)) {
+            while (i < length && is_word_char(line[i])) i++;
+            if (is_keyword(&line[begin], i - begin)) class = HL_KEYWORD;
+        } else if (c == '#' && indent) {
+            i++;
+            while (i < length && isalpha((unsigned char)line[i])) i++;
+            class = HL_PREPROCESSOR;
+        } else {
+            i++;
+        }
+
+        if (!isspace((unsigned char)c)) indent = false;
+        if (classes != NULL) memset(&classes[begin], class, i - begin);
+    }
+    return state;
+}
+
+// Returns the first length bytes of row in one piece, copying them out if the gap is in the way
+const char *highlight_line(struct row *row, size_t length) {
+    if (highlighter.capacity < length) {
+        free(highlighter.line);
+        free(highlighter.classes);
+        highlighter.capacity = length * 2;
+        highlighter.line = malloc(highlighter.capacity);
+        highlighter.classes = malloc(highlighter.capacity);
+        if (highlighter.line == NULL || highlighter.classes == NULL) die("highlight_line");
+    }
+
+    if (length <= row->gap) return row->data;
+    copy_row(row, 0, highlighter.line, length);
+    return highlighter.line;
+}
+
+// Brings the states of rows before end up to date, lexing at most
+// HIGHLIGHT_SLICE rows, and returns whether it got all the way there
+bool update_highlight(size_t end) {
+    if (end > row_count()) end = row_count();
+
+    int state = buffer->highlighted == 0 ? HL_NORMAL : get_row(buffer->highlighted - 1)->hl_end;
+    size_t lexed = 0;
+    while (buffer->highlighted < end) {
+        struct row *row = get_row(buffer->highlighted);
+        if (row->hl_dirty || row->hl_start != state) {
+            if (lexed++ == HIGHLIGHT_SLICE) return false;
+            row->hl_start = state;
+            row->hl_end = lex_row(highlight_line(row, row->size), row->size, state, NULL);
+            row->hl_dirty = false;
+        }
+        state = row->hl_end;
+        buffer->highlighted++;
+    }
+    return true;
+}
+
+void schedule_highlight(size_t end);
+
+void run_highlight(void *data) {
+    highlighter.scheduled = false;
+    if (!buffer->highlight) return;
+    if (!update_highlight(highlighter.target)) schedule_highlight(highlighter.target);
+}
+
+// Rows are drawn with whatever states they have cached, and bringing those up
+// to date is left to the event loop, so it happens after the frame is out
+void schedule_highlight(size_t end) {
+    highlighter.target = end;
+    if (highlighter.scheduled) return;
+    add_timer(0, 0, run_highlight, NULL);
+    highlighter.scheduled = true;
+}
+
+/* File io */
+
+void append_borrowed_row(size_t offset, size_t length) {
+    borrow_row(insert_row(row_count()), &buffer->map[offset], length);
+}
+
+// Splits more of the mapping into borrowed rows until there are at least
+// `count` rows or the whole file has been indexed. Indexing goes a chunk at a
+// time, and an empty tree always gets its first chunk
+bool search_running();
+
+void index_rows(size_t count) {
+    if (row_count() >= count && row_count() > 0) return;
+    // Pool workers read the leaves while a search runs, so nothing may be
+    // inserted among them. Rendering indexes further once it is over
+    if (search_running()) return;
+    if (count < row_count() + INDEX_CHUNK_ROWS) count = row_count() + INDEX_CHUNK_ROWS;
+
+    size_t starts[INDEX_CHUNK_ROWS];
+    while (buffer->indexed < buffer->map_size && row_count() < count) {
+        size_t wanted = count - row_count();
+        if (wanted > INDEX_CHUNK_ROWS) wanted = INDEX_CHUNK_ROWS;
+
+        size_t base = buffer->indexed;
+        size_t found = scan_line_starts(&buffer->map[base], buffer->map_size - base, starts, wanted);
+        if (found == 0) {
+            append_borrowed_row(base, buffer->map_size - base);
+            buffer->indexed = buffer->map_size;
+            break;
+        }
+
+        for (size_t i = 0; i < found; i++) {
+            size_t start = base + starts[i];
+            append_borrowed_row(buffer->indexed, start - buffer->indexed - 1);
+            buffer->indexed = start;
+        }
+    }
+}
+
+bool fully_indexed() {
+    return buffer->indexed == buffer->map_size;
+}
+
+#define STREAM_THRESHOLD (4ULL << 30)   // Files this big are streamed
+#define STRIPE_BYTES (16 << 20)
+
+struct stripe {
+    struct job job;
+    struct mapping *mapping;
+    size_t start;
+    size_t length;
+    size_t newlines;
+    bool done;
+};
+
+size_t count_newlines(const char *data, size_t length) {
+    size_t starts[INDEX_CHUNK_ROWS];
+    size_t count = 0;
+    size_t offset = 0;
+    size_t found;
+    while ((found = scan_line_starts(&data[offset], length - offset, starts, INDEX_CHUNK_ROWS)) > 0) {
+        count += found;
+        offset += starts[found - 1];
+    }
+    return count;
+}
+
+// The offset just past the count-th newline from offset, or the end of the file
+size_t skip_lines(struct mapping *mapping, size_t offset, size_t count) {
+    size_t starts[INDEX_CHUNK_ROWS];
+    while (count > 0) {
+        size_t wanted = count < INDEX_CHUNK_ROWS ? count : INDEX_CHUNK_ROWS;
+        size_t found = scan_line_starts(&mapping->data[offset], mapping->size - offset, starts, wanted);
+        if (found == 0) return mapping->size;
+        offset += starts[found - 1];
+        count -= found;
+    }
+    return offset;
+}
+
+void run_stripe(struct job *job, int worker) {
+    struct stripe *stripe = job->data;
+    const char *data = &stripe->mapping->data[stripe->start];
+    stripe->newlines = count_newlines(data, stripe->length);
+
+    // The pages come back from the file if they are needed, so counting
+    // doesn't keep the whole file resident
+    madvise((void *)data, stripe->length, MADV_DONTNEED);
+}
+
+// Stripes finish in any order, and the prefix sums grow while they are in order
+void stripe_done(struct job *job) {
+    struct stripe *stripe = job->data;
+    struct mapping *mapping = stripe->mapping;
+    stripe->done = true;
+    while (mapping->counted < mapping->n_stripes && mapping->stripes[mapping->counted].done) {
+        mapping->lines[mapping->counted + 1] = mapping->lines[mapping->counted] + mapping->stripes[mapping->counted].newlines;
+        mapping->counted++;
+    }
+}
+
+void start_checkpoints(struct mapping *mapping) {
+    mapping->n_stripes = (mapping->size + STRIPE_BYTES - 1) / STRIPE_BYTES;
+    mapping->stripes = calloc(mapping->n_stripes, sizeof(struct stripe));
+    mapping->lines = malloc((mapping->n_stripes + 1) * sizeof(size_t));
+    mapping->token = calloc(1, sizeof(struct cancel_token));
+    if (mapping->stripes == NULL || mapping->lines == NULL || mapping->token == NULL) die("start_checkpoints");
+    mapping->lines[0] = 0;
+
+    for (size_t i = 0; i < mapping->n_stripes; i++) {
+        struct stripe *stripe = &mapping->stripes[i];
+        stripe->mapping = mapping;
+        stripe->start = i * STRIPE_BYTES;
+        stripe->length = mapping->size - stripe->start < STRIPE_BYTES ? mapping->size - stripe->start : STRIPE_BYTES;
+        stripe->job = (struct job){
+            .run = run_stripe,
+            .done = stripe_done,
+            .data = stripe,
+            .token = mapping->token,
+        };
+        submit_job(&stripe->job);
+    }
+}
+
+// The line that starts at offset, or SIZE_MAX if the stripes before it haven't been counted yet
+size_t line_at(struct mapping *mapping, size_t offset) {
+    size_t stripe = offset / STRIPE_BYTES;
+    if (stripe > mapping->counted) return SIZE_MAX;
+    size_t start = stripe * STRIPE_BYTES;
+    return mapping->lines[stripe] + count_newlines(&mapping->data[start], offset - start);
+}
+
+// Where line starts, found by reading only the stripe it is in, or SIZE_MAX if
+// that stripe hasn't been counted yet. Lines past the end give the last line
+size_t line_offset(struct mapping *mapping, size_t line) {
+    if (line == 0) return 0;
+
+    // The line starts after its line-th newline, in the last stripe with fewer newlines before it
+    size_t low = 0;
+    size_t high = mapping->counted;
+    while (low < high) {
+        size_t middle = (low + high + 1) / 2;
+        if (mapping->lines[middle] < line) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    if (low == mapping->counted && mapping->counted < mapping->n_stripes) return SIZE_MAX;
+
+    size_t offset = mapping->size;
+    if (low < mapping->n_stripes) offset = skip_lines(mapping, low * STRIPE_BYTES, line - mapping->lines[low]);
+    if (offset == mapping->size) {
+        const char *newline = memrchr(mapping->data, '\n', mapping->size - 1);
+        offset = newline != NULL ? newline - mapping->data + 1 : 0;
+    }
+    return offset;
+}
+
+// Maps fd read-only, unless another buffer has the same version of the file
+// mapped already, in which case fd is closed and that mapping is shared
+struct mapping *map_file(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+
+    for (struct mapping *mapping = buffers.mappings; mapping != NULL; mapping = mapping->next) {
+        if (mapping->dev == st.st_dev && mapping->ino == st.st_ino && mapping->size == (size_t)st.st_size &&
+            mapping->mtime.tv_sec == st.st_mtim.tv_sec && mapping->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            close(fd);
+            mapping->refs++;
+            return mapping;
+        }
+    }
+
+    struct mapping *mapping = malloc(sizeof(struct mapping));
+    if (mapping == NULL) die("map_file");
+    *mapping = (struct mapping){
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime = st.st_mtim,
+        .fd = fd,
+        .data = NULL,
+        .refs = 1,
+        .next = buffers.mappings,
+        .stripes = NULL,
+    };
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) die("mmap");
+        mapping->data = map;
+    }
+    if (mapping->size >= STREAM_THRESHOLD) start_checkpoints(mapping);
+    buffers.mappings = mapping;
+    return mapping;
+}
+
+void release_mapping(struct mapping *mapping) {
+    if (--mapping->refs > 0) return;
+
+    struct mapping **link = &buffers.mappings;
+    while (*link != mapping) link = &(*link)->next;
+    *link = mapping->next;
+
+    if (mapping->stripes != NULL) {
+        cancel_jobs(mapping->token);
+        free(mapping->stripes);
+        free(mapping->lines);
+        free(mapping->token);
+    }
+    if (mapping->data != NULL) munmap((void *)mapping->data, mapping->size);
+    close(mapping->fd);
+    free(mapping);
+}
+
+void recover_swap();
+
+// Maps the file read-only and indexes only the first few rows; the rest are
+// split off lazily as the cursor reaches them. A file that doesn't exist yet
+// opens as an empty document, and any other failure leaves errno set. Edits
+// that a crash left in a swap file are replayed on top
+bool open_file(const char *filename) {
+    close_buffer();
+    buffer->filename = strdup(filename);
+    if (buffer->filename == NULL) die("open_file");
+    buffer->highlight = wants_highlight(filename);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 && errno != ENOENT) return false;
+    if (fd == -1) {
+        recover_swap();
+        return true;
+    }
+
+    struct mapping *mapping = map_file(fd);
+    buffer->mapping = mapping;
+    buffer->map_fd = mapping->fd;
+    buffer->trailing_newline = false;
+    if (mapping->size > 0) {
+        buffer->map = mapping->data;
+        buffer->map_size = mapping->size;
+        buffer->trailing_newline = buffer->map[buffer->map_size - 1] == '\n';
+        buffer->streaming = mapping->stripes != NULL;
+        remove_row(0);
+        index_rows(0);
+    }
+    recover_swap();
+    return true;
+}
+
+// Following a file reads whatever is appended to it as it arrives, into blocks
+// that the new rows borrow, so appends cost as much as the bytes appended
+#define FOLLOW_BLOCK (1 << 20)
+#define FOLLOW_SLICE (64 << 20)     // Most bytes read at once, so keys aren't held up by a fast writer
+
+int inotify_fd = -1;
+int follow_timer = -1;
+
+// Adds a line, or the start of one, to the end of the document. A last row
+// without a newline is still being written, so it gets the bytes that follow
+void append_line(const char *bytes, size_t length, bool newline) {
+    if (buffer->trailing_newline) {
+        borrow_row(insert_row(row_count()), bytes, length);
+    } else if (length > 0) {
+        struct row *row = modify_row(row_count() - 1);
+        if (row->borrowed && row->data + row->size == bytes) {
+            // Still in the same block, right after the part read before
+            row->size += length;
+            row->capacity = row->size;
+            row->gap = row->size;
+        } else {
+            insert_bytes(row, row->size, bytes, length);
+        }
+    }
+    buffer->trailing_newline = newline;
+}
+
+void append_tail(const char *bytes, size_t length) {
+    size_t starts[INDEX_CHUNK_ROWS];
+    size_t line = 0;
+    while (line < length) {
+        size_t found = scan_line_starts(&bytes[line], length - line, starts, INDEX_CHUNK_ROWS);
+        if (found == 0) {
+            append_line(&bytes[line], length - line, false);
+            return;
+        }
+
+        size_t base = line;
+        for (size_t i = 0; i < found; i++) {
+            size_t next = base + starts[i];
+            append_line(&bytes[line], next - line - 1, true);
+            line = next;
+        }
+    }
+}
+
+// Reads up to FOLLOW_SLICE bytes appended to the file and returns whether it
+// got to the end. A cursor on the last row stays there, like tail -f
+bool read_appended(bool shown) {
+    bool at_end = buffer->cy == row_count() - 1;
+    size_t total = 0;
+    bool done = false;
+    while (total < FOLLOW_SLICE) {
+        if (buffer->follow_block == NULL || buffer->follow_used == FOLLOW_BLOCK) {
+            struct pasted *block = arena_alloc(&buffer->arena, sizeof(struct pasted) + FOLLOW_BLOCK);
+            block->capacity = FOLLOW_BLOCK;
+            block->next = buffer->pasted;
+            buffer->pasted = block;
+            buffer->follow_block = block;
+            buffer->follow_used = 0;
+        }
+
+        char *bytes = &buffer->follow_block->text[buffer->follow_used];
+        ssize_t n = pread(buffer->map_fd, bytes, FOLLOW_BLOCK - buffer->follow_used, buffer->followed);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            done = true;
+            break;
+        }
+
+        if (total == 0 && shown) before_edit();
+        buffer->follow_used += n;
+        buffer->followed += n;
+        total += n;
+        append_tail(bytes, n);
+    }
+
+    if (at_end && buffer->cy != row_count() - 1) {
+        buffer->cy = row_count() - 1;
+        buffer->cx = 0;
+    }
+    return done;
+}
+
+// Catches up with every followed file, a slice at a time between other events
+void follow_files(void *data) {
+    follow_timer = -1;
+    bool done = true;
+
+    // The document functions work on the buffer on screen, so each followed one is put there in turn
+    struct buffer *shown = buffer;
+    for (size_t i = 0; i < buffers.count; i++) {
+        buffer = buffers.list[i];
+        if (buffer->follow_watch == -1) continue;
+
+        struct stat st;
+        if (fstat(buffer->map_fd, &st) == 0 && (size_t)st.st_size < buffer->followed) {
+            stop_following();
+            if (buffer == shown) set_message("%s was truncated, stopped following it", buffer->filename);
+            continue;
+        }
+        if (!read_appended(buffer == shown)) done = false;
+    }
+    buffer = shown;
+
+    if (!done) follow_timer = add_timer(0, 0, follow_files, NULL);
+}
+
+void handle_file_events(void *data) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(inotify_fd, events, sizeof(events)) > 0) {}
+    if (follow_timer == -1) follow_files(NULL);
+}
+
+// Buffers of the same file get the same watch, which goes when the last one stops
+void stop_following() {
+    int watch = buffer->follow_watch;
+    if (watch == -1) return;
+    buffer->follow_watch = -1;
+    buffer->follow_block = NULL;
+
+    for (size_t i = 0; i < buffers.count; i++) {
+        if (buffers.list[i]->follow_watch == watch) return;
+    }
+    inotify_rm_watch(inotify_fd, watch);
+}
+
+void toggle_follow() {
+    if (buffer->follow_watch != -1) {
+        stop_following();
+        set_message("Stopped following %s", buffer->filename);
+        return;
+    }
+    if (buffer->mapping == NULL || buffer->streaming) {
+        set_message(buffer->mapping == NULL ? "Only files on disk can be followed" : "Files this big can't be followed");
+        return;
+    }
+
+    if (inotify_fd == -1) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1) {
+            set_message("Can't follow files: %s", strerror(errno));
+            return;
+        }
+        watch_fd(inotify_fd, handle_file_events, NULL);
+    }
+
+    int watch = inotify_add_watch(inotify_fd, buffer->filename, IN_MODIFY);
+    if (watch == -1) {
+        set_message("Can't follow %s: %s", buffer->filename, strerror(errno));
+        return;
+    }
+
+    // Appends go after the last row, so the rows before them have to be there
+    index_rows(SIZE_MAX);
+    buffer->follow_watch = watch;
+    buffer->followed = buffer->map_size;
+    set_message("Following %s", buffer->filename);
+    if (follow_timer == -1) follow_files(NULL);
+}
+
+// State for streaming the document into a file. Edited rows are gathered into
+// iovecs for writev, while runs of rows still borrowed from the mapping (and
+// the part of the file never indexed) are copied between the files by the kernel
+struct save {
+    int fd;
+    int n_iov;
+    struct iovec iov[IOV_MAX];
+    off_t span_start;
+    size_t span_length;
+    size_t rows_left;
+    size_t written;
+    bool failed;
+};
+
+void flush_iov(struct save *save) {
+    struct iovec *iov = save->iov;
+    int count = save->n_iov;
+    save->n_iov = 0;
+
+    while (count > 0 && !save->failed) {
+        ssize_t n = writev(save->fd, iov, count);
+        if (n == -1) {
+            if (errno != EINTR) save->failed = true;
+            continue;
+        }
+        save->written += n;
+
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+void flush_span(struct save *save) {
+    off_t offset = save->span_start;
+    size_t left = save->span_length;
+    save->span_length = 0;
+
+    while (left > 0 && !save->failed) {
+        ssize_t n = copy_file_range(buffer->map_fd, &offset, save->fd, NULL, left, 0);
+        if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            n = sendfile(save->fd, buffer->map_fd, &offset, left);
+        }
+        if (n == -1 && (errno == ENOSYS || errno == EINVAL)) {
+            n = write(save->fd, &buffer->map[offset], left);
+            if (n > 0) offset += n;
+        }
+
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            save->failed = true;
+            break;
+        }
+        left -= n;
+        save->written += n;
+    }
+}
+
+void save_bytes(struct save *save, const char *bytes, size_t length) {
+    if (length == 0) return;
+    if (save->span_length > 0) flush_span(save);
+    if (save->n_iov == IOV_MAX) flush_iov(save);
+
+    save->iov[save->n_iov++] = (struct iovec){ .iov_base = (void *)bytes, .iov_len = length };
+}
+
+void save_span(struct save *save, size_t offset, size_t length) {
+    if (length == 0) return;
+    if (save->n_iov > 0) flush_iov(save);
+
+    if (save->span_length > 0 && save->span_start + save->span_length == offset) {
+        save->span_length += length;
+        return;
+    }
+    if (save->span_length > 0) flush_span(save);
+    save->span_start = offset;
+    save->span_length = length;
+}
+
+void save_row(struct save *save, struct row *row) {
+    bool last = --save->rows_left == 0 && fully_indexed();
+    bool newline = !last || buffer->trailing_newline;
+
+    if (row->borrowed && row->data >= buffer->map && row->data < buffer->map + buffer->map_size) {
+        size_t offset = row->data - buffer->map;
+        bool mapped_newline = newline && offset + row->size < buffer->map_size;
+        save_span(save, offset, row->size + mapped_newline);
+        if (newline && !mapped_newline) save_bytes(save, "\n", 1);
+        return;
+    }
+
+    save_bytes(save, row->data, row->gap);
+    save_bytes(save, &row->data[gap_end(row)], row->size - row->gap);
+    if (newline) save_bytes(save, "\n", 1);
+}
+
+void save_node(struct save *save, struct node *node) {
+    for (int i = 0; i < node->count && !save->failed; i++) {
+        if (node->leaf) {
+            save_row(save, &node->rows[i]);
+        } else {
+            save_node(save, node->children[i]);
+        }
+    }
+}
+
+void swap_saved();
+
+// Writes the buffer to a temporary file next to the real one, syncs it and
+// renames it into place, so a crash leaves either the old file or the new one
+void save_file() {
+    if (buffer->filename == NULL) {
+        set_message("No file name");
+        return;
+    }
+
+    char dir[PATH_MAX];
+    const char *slash = strrchr(buffer->filename, '/');
+    const char *base = slash != NULL ? slash + 1 : buffer->filename;
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == buffer->filename) {
+        strcpy(dir, "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - buffer->filename), buffer->filename);
+    }
+
+    char temp[PATH_MAX];
+    if (snprintf(temp, sizeof(temp), "%s/.%s.XXXXXX", dir, base) >= (int)sizeof(temp)) {
+        set_message("Can't save: file name too long");
+        return;
+    }
+
+    struct save *save = malloc(sizeof(struct save));
+    if (save == NULL) die("save_file");
+    *save = (struct save){ .rows_left = row_count() };
+
+    save->fd = mkstemp(temp);
+    if (save->fd == -1) {
+        set_message("Can't save: %s", strerror(errno));
+        free(save);
+        return;
+    }
+
+    struct stat st;
+    mode_t mode;
+    if (stat(buffer->filename, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+
+    save_span(save, 0, buffer->window_start);
+    save_node(save, buffer->root);
+    if (!save->failed && !fully_indexed()) save_span(save, buffer->indexed, buffer->map_size - buffer->indexed);
+    if (save->n_iov > 0) flush_iov(save);
+    if (save->span_length > 0) flush_span(save);
+
+    if (!save->failed && (fchmod(save->fd, mode) == -1 || fsync(save->fd) == -1)) save->failed = true;
+    if (close(save->fd) == -1) save->failed = true;
+    if (!save->failed && rename(temp, buffer->filename) == -1) save->failed = true;
+
+    if (save->failed) {
+        set_message("Can't save: %s", strerror(errno));
+        unlink(temp);
+        free(save);
+        return;
+    }
+
+    // Make the rename itself durable
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    set_message("Wrote %zu bytes to %s", save->written, buffer->filename);
+    free(save);
+    swap_saved();
+}
+
+/* Swap files */
+
+// Every edit is logged to a swap file beside its file, so that after a crash
+// the edits can be replayed on top of the file as it was. Records collect in
+// memory and are appended by a job on the pool every SWAP_INTERVAL, which
+// syncs the file at most every SWAP_SYNC, so logging costs as much as the
+// edits did however big the file is
+#define SWAP_INTERVAL 500
+#define SWAP_SYNC 5000
+#define SWAP_MAGIC "editor swap 1\n"
+
+// What the edits were made on top of, which the file has to match for them to be replayed
+struct swap_header {
+    char magic[16];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t window_start;      // Where row 0 starts in a streamed file
+};
+
+// Followed by length bytes of text, inserted at (y, x) or deleted from there,
+// or by a replace all to go forward or back through for SWAP_REPLACE and SWAP_UNREPLACE
+struct swap_record {
+    uint64_t insert;
+    uint64_t y;
+    uint64_t x;
+    uint64_t length;
+};
+
+struct swap {
+    char *path;
+    int fd;                     // -1 if the swap file couldn't be had, and nothing is logged
+    char *pending;              // Records not handed to the job yet
+    size_t pending_size;
+    size_t pending_capacity;
+    bool truncate;              // pending starts with a new header, so the file is emptied first
+
+    // What the job writes, swapped with pending when it is submitted
+    char *writing;
+    size_t writing_size;
+    size_t writing_capacity;
+    bool writing_truncate;
+    bool sync;
+
+    bool busy;                  // The job is on the pool
+    bool unsynced;              // Written to since the last sync
+    long long synced;
+    int error;                  // errno of the last write that failed, for done to report
+    struct job job;
+    struct cancel_token token;
+};
+
+int swap_timer = -1;
+
+// .name.swp in the same directory as filename
+char *swap_path(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    int prefix = slash != NULL ? slash + 1 - filename : 0;
+    size_t size = strlen(filename) + 6;
+    char *path = malloc(size);
+    if (path == NULL) die("swap_path");
+    snprintf(path, size, "%.*s.%s.swp", prefix, filename, &filename[prefix]);
+    return path;
+}
+
+void append_swap(struct swap *swap, const void *bytes, size_t length) {
+    if (swap->pending_size + length > swap->pending_capacity) {
+        size_t capacity = swap->pending_capacity ? swap->pending_capacity * 2 : 4096;
+        while (capacity < swap->pending_size + length) capacity *= 2;
+        swap->pending = realloc(swap->pending, capacity);
+        if (swap->pending == NULL) die("append_swap");
+        swap->pending_capacity = capacity;
+    }
+    memcpy(&swap->pending[swap->pending_size], bytes, length);
+    swap->pending_size += length;
+}
+
+// Throws away what is pending and starts the file over, for edits made on
+// top of a file of size bytes last modified at mtime
+void restart_swap(struct swap *swap, size_t size, struct timespec mtime) {
+    struct swap_header header = {
+        .size = size,
+        .mtime_sec = mtime.tv_sec,
+        .mtime_nsec = mtime.tv_nsec,
+        .window_start = buffer->window_start,
+    };
+    memcpy(header.magic, SWAP_MAGIC, strlen(SWAP_MAGIC));
+    swap->pending_size = 0;
+    append_swap(swap, &header, sizeof(header));
+    swap->truncate = true;
+}
+
+void flush_swaps(void *data);
+
+void log_edit(uint64_t kind, size_t y, size_t x, const char *text, size_t length) {
+    if (buffer->filename == NULL) return;
+
+    if (buffer->swap == NULL) {
+        struct swap *swap = calloc(1, sizeof(struct swap));
+        if (swap == NULL) die("log_edit");
+        swap->path = swap_path(buffer->filename);
+        swap->fd = -1;
+        buffer->swap = swap;
+
+        // Two buffers of one file would write over each other's edits
+        for (size_t i = 0; i < buffers.count; i++) {
+            struct swap *other = buffers.list[i]->swap;
+            if (other != NULL && other != swap && other->fd != -1 && strcmp(other->path, swap->path) == 0) {
+                set_message("%s is in use by another buffer, edits here won't be recoverable", swap->path);
+                return;
+            }
+        }
+
+        swap->fd = open(swap->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (swap->fd == -1) {
+            set_message("Can't open swap file %s: %s", swap->path, strerror(errno));
+            return;
+        }
+        struct mapping *mapping = buffer->mapping;
+        restart_swap(swap, mapping != NULL ? mapping->size : 0, mapping != NULL ? mapping->mtime : (struct timespec){ 0, 0 });
+    }
+
+    struct swap *swap = buffer->swap;
+    if (swap->fd == -1) return;
+    struct swap_record record = { .insert = kind, .y = y, .x = x, .length = length };
+    append_swap(swap, &record, sizeof(record));
+    append_swap(swap, text, length);
+    if (swap_timer == -1) swap_timer = add_timer(SWAP_INTERVAL, SWAP_INTERVAL, flush_swaps, NULL);
+}
+
+void run_swap_job(struct job *job, int worker) {
+    struct swap *swap = job->data;
+    if (swap->writing_truncate && ftruncate(swap->fd, 0) == -1) swap->error = errno;
+
+    size_t written = 0;
+    while (written < swap->writing_size) {
+        ssize_t n = write(swap->fd, &swap->writing[written], swap->writing_size - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            swap->error = errno;
+            break;
+        }
+        written += n;
+    }
+    if (swap->sync && fdatasync(swap->fd) == -1) swap->error = errno;
+}
+
+void swap_job_done(struct job *job) {
+    struct swap *swap = job->data;
+    swap->busy = false;
+    if (swap->error != 0) {
+        set_message("Can't write swap file %s: %s", swap->path, strerror(swap->error));
+        swap->error = 0;
+    }
+}
+
+// Hands every swap file's pending records to the pool, and a sync along with
+// them if the last one was long enough ago. Stops once nothing is left to do
+void flush_swaps(void *data) {
+    long long now = now_ms();
+    bool idle = true;
+
+    for (size_t i = 0; i < buffers.count; i++) {
+        struct swap *swap = buffers.list[i]->swap;
+        if (swap == NULL || swap->fd == -1) continue;
+        if (swap->busy) {
+            idle = false;
+            continue;
+        }
+
+        bool sync_due = now - swap->synced >= SWAP_SYNC;
+        if (swap->pending_size == 0 && !(swap->unsynced && sync_due)) continue;
+        idle = false;
+
+        char *writing = swap->writing;
+        size_t capacity = swap->writing_capacity;
+        swap->writing = swap->pending;
+        swap->writing_size = swap->pending_size;
+        swap->writing_capacity = swap->pending_capacity;
+        swap->writing_truncate = swap->truncate;
+        swap->pending = writing;
+        swap->pending_size = 0;
+        swap->pending_capacity = capacity;
+        swap->truncate = false;
+
+        swap->sync = sync_due;
+        swap->unsynced = !sync_due;
+        if (sync_due) swap->synced = now;
+
+        swap->busy = true;
+        swap->job = (struct job){ .run = run_swap_job, .done = swap_job_done, .data = swap, .token = &swap->token };
+        submit_job(&swap->job);
+    }
+
+    if (idle) {
+        cancel_timer(swap_timer);
+        swap_timer = -1;
+    }
+}
+
+// Waits for the job, if it is out, without running its done callback. The
+// worker only lets go of the token after handing the job back, which can be
+// after done has run, so the token is waited on even when the job isn't busy
+void settle_swap(struct swap *swap) {
+    cancel_jobs(&swap->token);
+    reset_token(&swap->token);
+    swap->busy = false;
+}
+
+// Everything is in the file now, so the swap file starts over on top of it
+void swap_saved() {
+    struct swap *swap = buffer->swap;
+    if (swap == NULL || swap->fd == -1) return;
+
+    settle_swap(swap);
+    struct stat st;
+    if (stat(buffer->filename, &st) == -1) return;
+    restart_swap(swap, st.st_size, st.st_mtim);
+    if (swap_timer == -1) swap_timer = add_timer(SWAP_INTERVAL, SWAP_INTERVAL, flush_swaps, NULL);
+}
+
+// The edits are given up on along with the buffer, so its swap file goes
+void close_swap() {
+    struct swap *swap = buffer->swap;
+    if (swap == NULL) return;
+
+    settle_swap(swap);
+    if (swap->fd != -1) {
+        close(swap->fd);
+        unlink(swap->path);
+    }
+    free(swap->path);
+    free(swap->pending);
+    free(swap->writing);
+    free(swap);
+    buffer->swap = NULL;
+}
+
+// Quitting the editor gives up on every buffer's edits. Only a crash leaves swap files behind
+void remove_swap_files() {
+    struct buffer *shown = buffer;
+    for (size_t i = 0; i < buffers.count; i++) {
+        buffer = buffers.list[i];
+        close_swap();
+    }
+    buffer = shown;
+}
+
+void jump_window(size_t offset);
+bool replace_fits(const char *text, size_t length, bool forward);
+
+// Checks that a record's text fits where it goes: anywhere for an insert, over
+// text that is there for a delete, over its matches for a replace all
+bool replayable(struct swap_record *record, const char *text) {
+    if (record->insert == SWAP_REPLACE || record->insert == SWAP_UNREPLACE) {
+        return replace_fits(text, record->length, record->insert == SWAP_REPLACE);
+    }
+    index_rows(record->y + 2);
+    if (record->y >= row_count() || record->x > get_row(record->y)->size) return false;
+    if (record->insert) return true;
+
+    size_t end_y, end_x;
+    text_end(record->y, record->x, text, record->length, &end_y, &end_x);
+    index_rows(end_y + 2);
+    return end_y < row_count() && end_x <= get_row(end_y)->size;
+}
+
+void recover_swap() {
+    char *path = swap_path(buffer->filename);
+    for (size_t i = 0; i < buffers.count; i++) {
+        struct swap *other = buffers.list[i]->swap;
+        if (other != NULL && other->fd != -1 && strcmp(other->path, path) == 0) {
+            free(path);
+            return;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct swap_header)) {
+        if (fd != -1) close(fd);
+        free(path);
+        return;
+    }
+
+    size_t size = st.st_size;
+    char *data = malloc(size);
+    if (data == NULL) die("recover_swap");
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, &data[got], size - got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    size = got;
+
+    struct swap_header header;
+    memcpy(&header, data, sizeof(header));
+    struct mapping *mapping = buffer->mapping;
+    size_t file_size = mapping != NULL ? mapping->size : 0;
+    struct timespec mtime = mapping != NULL ? mapping->mtime : (struct timespec){ 0, 0 };
+    if (memcmp(header.magic, SWAP_MAGIC, strlen(SWAP_MAGIC)) != 0 || header.size != file_size ||
+        header.mtime_sec != mtime.tv_sec || header.mtime_nsec != mtime.tv_nsec) {
+        set_message("%s has changed since %s was written, its edits can't be recovered", buffer->filename, path);
+        free(data);
+        free(path);
+        return;
+    }
+
+    if (buffer->streaming && header.window_start != buffer->window_start) jump_window(header.window_start);
+
+    // A record cut short by the crash ends the replay, as does one that doesn't fit
+    size_t count = 0;
+    size_t offset = sizeof(header);
+    while (offset + sizeof(struct swap_record) <= size) {
+        struct swap_record record;
+        memcpy(&record, &data[offset], sizeof(record));
+        const char *text = &data[offset + sizeof(record)];
+        if (record.length > size - offset - sizeof(record) || !replayable(&record, text)) break;
+        offset += sizeof(record) + record.length;
+
+        if (record.insert == SWAP_REPLACE || record.insert == SWAP_UNREPLACE) {
+            char *copy = malloc(record.length);
+            if (copy == NULL) die("recover_swap");
+            memcpy(copy, text, record.length);
+            before_edit();
+            bool forward = record.insert == SWAP_REPLACE;
+            apply_edit(record_replace(forward, copy, record.length), forward);
+            count++;
+            continue;
+        }
+
+        size_t y = record.y;
+        size_t x = record.x;
+        before_edit();
+        record_edit(record.insert, y, x, text, record.length, false);
+        if (record.insert) {
+            insert_copy(&y, &x, text, record.length);
+        } else {
+            size_t end_y, end_x;
+            text_end(y, x, text, record.length, &end_y, &end_x);
+            delete_range(y, x, end_y, end_x);
+        }
+        buffer->cy = y;
+        buffer->cx = x;
+        count++;
+    }
+
+    if (count > 0) set_message("Recovered %zu edits from %s", count, path);
+    free(data);
+    free(path);
+}
+
+/* Search */
+
+#define QUERY_SIZE 256
+
+struct match {
+    size_t y;
+    size_t x;
+    size_t length;
+};
+
+// Searches are split along the leaves of the row tree, and the leaves are
+// searched on the pool and merged in order as they finish
+struct chunk {
+    struct node *leaf;
+    size_t first_row;
+    bool index;                 // Rebuild the leaf's trigrams while scanning it
+    size_t n_matches;
+    size_t capacity;
+    struct match *matches;
+    bool done;
+    struct job job;
+};
+
+struct {
+    bool running;
+    char query[QUERY_SIZE];
+    bool literal;               // The query has no regex syntax, so memmem alone finds matches
+    char prefilter[QUERY_SIZE]; // Text every regex match has to contain
+    size_t prefilter_length;
+
+    size_t n_chunks;
+    struct chunk *chunks;
+    size_t n_pending;           // Chunks that had to be scanned, the rest were done right away
+    struct cancel_token token;
+
+    // glibc serializes regexec on a shared pattern, so every pool thread
+    // compiles its own the first time it gets a chunk
+    bool compiled[MAX_POOL_THREADS];
+    regex_t regexes[MAX_POOL_THREADS];
+    char *scratch[MAX_POOL_THREADS];
+    size_t scratch_size[MAX_POOL_THREADS];
+
+    size_t generation;          // Counts searches, so leaves can tell whose matches they cached
+    size_t merged;              // Chunks whose matches have been appended to matches
+    size_t n_matches;
+    size_t capacity;
+    struct match *matches;      // In document order
+    bool stale;                 // The document changed since matches were found
+    struct match *previous;     // Matches of the last search, which clean leaves take theirs from
+    bool jumped;                // Whether the cursor has been moved to a result yet
+    size_t start_y;
+    size_t start_x;
+    bool replacing;             // Every match is to be replaced once they are all in
+    char replacement[QUERY_SIZE];
+} search;
+
+bool add_match(struct match **matches, size_t *count, size_t *capacity, struct match match) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 16;
+        struct match *resized = realloc(*matches, grown * sizeof(struct match));
+        if (resized == NULL) return false;
+        *matches = resized;
+        *capacity = grown;
+    }
+    (*matches)[(*count)++] = match;
+    return true;
+}
+
+// Finds the longest run of plain characters that any match of an extended
+// regex has to contain, so most lines can be ruled out with memmem
+void extract_prefilter(const char *pattern) {
+    char run[QUERY_SIZE];
+    size_t run_length = 0;
+    int depth = 0;
+    search.prefilter_length = 0;
+
+    for (size_t i = 0; ; i++) {
+        char c = pattern[i];
+        char literal = 0;
+        if (c == '\\' && pattern[i + 1] != '\0' && ispunct((unsigned char)pattern[i + 1])) {
+            literal = pattern[++i];
+        } else if (c != '\0' && strchr(".[]()*+?{}|^$\\", c) == NULL) {
+            literal = c;
+        }
+
+        // Characters followed by a quantifier that allows zero of them are optional
+        char next = literal ? pattern[i + 1] : 0;
+        bool optional = next == '*' || next == '?' || next == '{';
+        if (literal && depth == 0 && !optional) {
+            run[run_length++] = literal;
+            if (next != '+') continue;
+        }
+
+        if (run_length > search.prefilter_length) {
+            memcpy(search.prefilter, run, run_length);
+            search.prefilter_length = run_length;
+        }
+        run_length = 0;
+
+        if (c == '\0') break;
+        if (c == '|') {
+            // Any branch could match, so there is no single required run
+            search.prefilter_length = 0;
+            return;
+        }
+        if (c == '(') depth++;
+        if (c == ')') depth--;
+        if (c == '\\' && pattern[i + 1] != '\0' && !literal) i++;
+        if (c == '[') {
+            i++;
+            if (pattern[i] == '^') i++;
+            if (pattern[i] == ']') i++;
+            while (pattern[i] != '\0' && pattern[i] != ']') i++;
+            if (pattern[i] == '\0') break;
+        }
+    }
+}
+
+uint32_t trigram_bit(unsigned char a, unsigned char b, unsigned char c) {
+    return (((uint32_t)a << 16 | b << 8 | c) * 2654435761u) % BLOOM_BITS;
+}
+
+void add_trigrams(uint64_t *bloom, const char *line, size_t length) {
+    for (size_t i = 2; i < length; i++) {
+        uint32_t bit = trigram_bit(line[i - 2], line[i - 1], line[i]);
+        bloom[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+// Whether text could occur in a leaf, judging by its trigrams; text shorter than a trigram always could
+bool may_contain(const uint64_t *bloom, const char *text, size_t length) {
+    for (size_t i = 2; i < length; i++) {
+        uint32_t bit = trigram_bit(text[i - 2], text[i - 1], text[i]);
+        if ((bloom[bit / 64] & (uint64_t)1 << (bit % 64)) == 0) return false;
+    }
+    return true;
+}
+
+void search_line(struct chunk *chunk, regex_t *regex, size_t y, const char *line, size_t length) {
+    size_t query_length = strlen(search.query);
+
+    size_t x = 0;
+    while (x <= length) {
+        size_t start, end;
+        if (search.literal) {
+            const char *found = memmem(&line[x], length - x, search.query, query_length);
+            if (found == NULL) return;
+            start = found - line;
+            end = start + query_length;
+        } else {
+            if (search.prefilter_length > 0
+                && memmem(&line[x], length - x, search.prefilter, search.prefilter_length) == NULL) return;
+
+            regmatch_t match = { .rm_so = x, .rm_eo = length };
+            if (regexec(regex, line, 1, &match, REG_STARTEND | (x > 0 ? REG_NOTBOL : 0)) != 0) return;
+            start = match.rm_so;
+            end = match.rm_eo;
+        }
+
+        struct match match = { .y = y, .x = start, .length = end - start };
+        if (!add_match(&chunk->matches, &chunk->n_matches, &chunk->capacity, match)) return;
+        x = end > start ? end : start + 1;
+    }
+}
+
+void search_chunk(struct chunk *chunk, regex_t *regex, char **scratch, size_t *scratch_size) {
+    struct node *leaf = chunk->leaf;
+
+    int i;
+    for (i = 0; i < leaf->count && !cancelled(&search.token); i++) {
+        struct row *row = &leaf->rows[i];
+        const char *line = row->data;
+
+        // Rows with text on both sides of the gap are searched from a copy
+        if (row->gap < row->size) {
+            if (*scratch_size < row->size) {
+                free(*scratch);
+                *scratch_size = row->size;
+                *scratch = malloc(*scratch_size);
+                if (*scratch == NULL) return;
+            }
+            copy_row(row, 0, *scratch, row->size);
+            line = *scratch;
+        }
+
+        if (chunk->index) add_trigrams(leaf->bloom, line, row->size);
+        search_line(chunk, regex, chunk->first_row + i, line, row->size);
+    }
+
+    // Only the main thread marks leaves dirty, and never while workers run
+    if (chunk->index && i == leaf->count) leaf->dirty = false;
+}
+
+void run_search_chunk(struct job *job, int worker) {
+    if (!search.literal && !search.compiled[worker]) {
+        search.compiled[worker] = regcomp(&search.regexes[worker], search.query, REG_EXTENDED) == 0;
+        if (!search.compiled[worker]) return;
+    }
+
+    regex_t *regex = search.literal ? NULL : &search.regexes[worker];
+    search_chunk(job->data, regex, &search.scratch[worker], &search.scratch_size[worker]);
+}
+
+void collect_search_results();
+void finish_replace();
+
+void search_chunk_done(struct job *job) {
+    struct chunk *chunk = job->data;
+    chunk->done = true;
+    collect_search_results();
+}
+
+void collect_leaves(struct node *node, size_t *first_row) {
+    if (node->leaf) {
+        struct chunk *chunk = &search.chunks[search.n_chunks++];
+        *chunk = (struct chunk){ .leaf = node, .first_row = *first_row };
+        *first_row += node->count;
+        return;
+    }
+
+    for (int i = 0; i < node->count; i++) {
+        collect_leaves(node->children[i], first_row);
+    }
+}
+
+size_t count_leaves(struct node *node) {
+    if (node->leaf) return 1;
+
+    size_t count = 0;
+    for (int i = 0; i < node->count; i++) {
+        count += count_leaves(node->children[i]);
+    }
+    return count;
+}
+
+void free_chunks() {
+    for (size_t i = 0; i < search.n_chunks; i++) {
+        free(search.chunks[i].matches);
+    }
+    free(search.chunks);
+    search.chunks = NULL;
+    search.n_chunks = 0;
+    search.n_pending = 0;
+}
+
+bool search_running() {
+    return search.running;
+}
+
+// Cleans up after a search once none of its jobs are running any more
+void end_search() {
+    for (int i = 0; i < MAX_POOL_THREADS; i++) {
+        if (search.compiled[i]) regfree(&search.regexes[i]);
+        search.compiled[i] = false;
+    }
+    search.running = false;
+    free_chunks();
+    free(search.previous);
+    search.previous = NULL;
+}
+
+// Stops a running search and marks its results out of date; the document is
+// about to change under them. They are kept for the leaves the edit leaves alone
+void before_edit() {
+    if (search.running) {
+        cancel_jobs(&search.token);
+        end_search();
+        search.replacing = false;
+    }
+    search.stale = true;
+}
+
+// Streamed files are only searched as far as they are loaded, which results have to say
+const char *search_scope() {
+    return buffer->streaming ? " in the loaded part of the file" : "";
+}
+
+// Moves the cursor to the first match after (y, x), wrapping around to the top
+bool jump_to_match(size_t y, size_t x, bool wrap) {
+    size_t low = 0;
+    size_t high = search.n_matches;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        struct match *match = &search.matches[middle];
+        if (match->y < y || (match->y == y && match->x <= x)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == search.n_matches) {
+        if (!wrap || search.n_matches == 0) return false;
+        low = 0;
+    }
+
+    buffer->cy = search.matches[low].y;
+    buffer->cx = search.matches[low].x;
+    set_message("Match %zu of %zu%s", low + 1, search.n_matches, search.running ? " so far" : "");
+    return true;
+}
+
+// Appends the results of chunks that are done, in document order, to the match list
+void collect_search_results() {
+    while (search.merged < search.n_chunks && search.chunks[search.merged].done) {
+        struct chunk *chunk = &search.chunks[search.merged++];
+        chunk->leaf->cache_search = search.generation;
+        chunk->leaf->cache_start = search.n_matches;
+        chunk->leaf->cache_count = chunk->n_matches;
+        chunk->leaf->cache_first_row = chunk->first_row;
+        for (size_t i = 0; i < chunk->n_matches; i++) {
+            if (!add_match(&search.matches, &search.n_matches, &search.capacity, chunk->matches[i])) die("collect_search_results");
+        }
+    }
+
+    if (search.merged == search.n_chunks) end_search();
+
+    if (!search.jumped) search.jumped = jump_to_match(search.start_y, search.start_x, !search.running);
+    if (!search.running && !search.jumped) set_message("No matches for %s%s", search.query, search_scope());
+    if (!search.running && search.jumped) set_message("%zu matches for %s%s", search.n_matches, search.query, search_scope());
+    if (!search.running && search.replacing) finish_replace();
+}
+
+// Queues a chunk for the workers unless its leaf is clean. Clean leaves take
+// their matches from the last search if it was for the same query, and are
+// skipped outright if their trigrams rule the query out
+void plan_chunk(struct chunk *chunk, size_t previous) {
+    struct node *leaf = chunk->leaf;
+    const char *needle = search.literal ? search.query : search.prefilter;
+    size_t needle_length = search.literal ? strlen(search.query) : search.prefilter_length;
+
+    if (!leaf->dirty && previous != 0 && leaf->cache_search == previous) {
+        for (size_t i = 0; i < leaf->cache_count; i++) {
+            struct match match = search.previous[leaf->cache_start + i];
+            match.y += chunk->first_row - leaf->cache_first_row;
+            if (!add_match(&chunk->matches, &chunk->n_matches, &chunk->capacity, match)) die("plan_chunk");
+        }
+        chunk->done = true;
+        return;
+    }
+
+    if (!leaf->dirty && !may_contain(leaf->bloom, needle, needle_length)) {
+        chunk->done = true;
+        return;
+    }
+
+    if (leaf->dirty) {
+        if (leaf->bloom == NULL) leaf->bloom = arena_alloc(&buffer->arena, BLOOM_BITS / 8);
+        memset(leaf->bloom, 0, BLOOM_BITS / 8);
+        chunk->index = true;
+    }
+
+    chunk->job = (struct job){
+        .run = run_search_chunk,
+        .done = search_chunk_done,
+        .data = chunk,
+        .token = &search.token,
+    };
+    submit_job(&chunk->job);
+    search.n_pending++;
+}
+
+void start_search(const char *query) {
+    before_edit();
+    if (query[0] == '\0') return;
+
+    bool literal = strpbrk(query, ".[]()*+?{}|^$\\") == NULL;
+    if (!literal) {
+        regex_t regex;
+        int error = regcomp(&regex, query, REG_EXTENDED);
+        if (error != 0) {
+            char reason[128];
+            regerror(error, &regex, reason, sizeof(reason));
+            set_message("Bad pattern: %s", reason);
+            return;
+        }
+        regfree(&regex);
+        extract_prefilter(query);
+    }
+
+    // Results of the last search are only worth reusing for the same query
+    size_t previous = strcmp(search.query, query) == 0 ? search.generation : 0;
+    // find_next hands search.query itself back in to search again
+    if (query != search.query) snprintf(search.query, sizeof(search.query), "%s", query);
+    search.literal = literal;
+    search.generation++;
+
+    free(search.previous);
+    search.previous = search.matches;
+    search.matches = NULL;
+    search.n_matches = 0;
+    search.capacity = 0;
+    search.stale = false;
+
+    // Workers read the row tree, so it has to be complete and must not change
+    // under them. Streamed files are only searched as far as they are loaded
+    if (!buffer->streaming) index_rows(SIZE_MAX);
+
+    search.chunks = malloc(count_leaves(buffer->root) * sizeof(struct chunk));
+    if (search.chunks == NULL) die("start_search");
+    size_t first_row = 0;
+    collect_leaves(buffer->root, &first_row);
+
+    search.running = true;
+    search.merged = 0;
+    search.jumped = false;
+    search.start_y = buffer->cy;
+    search.start_x = buffer->cx;
+    set_message("Searching for %s", query);
+
+    reset_token(&search.token);
+    for (size_t i = 0; i < search.n_chunks; i++) {
+        plan_chunk(&search.chunks[i], previous);
+    }
+
+    // Nothing for the pool to do means every chunk is done already
+    if (search.n_pending == 0) collect_search_results();
+}
+
+// Throws away the results of the last search, which belong to a buffer that
+// is going away from the screen. The query is kept for find_next
+void forget_search() {
+    if (search.running) {
+        cancel_jobs(&search.token);
+        end_search();
+    }
+    search.replacing = false;
+    free(search.matches);
+    search.matches = NULL;
+    search.n_matches = 0;
+    search.capacity = 0;
+    search.stale = true;
+    search.generation++;        // So no leaf's cached matches are taken for the next search's
+}
+
+// Jumps to the next match of the last query, searching again if edits made the results stale
+void find_next() {
+    if (search.query[0] == '\0') return;
+
+    if ((search.stale || search.n_matches == 0) && !search.running) {
+        start_search(search.query);
+    } else if (!jump_to_match(buffer->cy, buffer->cx, true)) {
+        set_message("No matches for %s%s", search.query, search_scope());
+    }
+}
+
+/* Printing */
+
+// Everything drawn for one input event is collected here and sent to the
+// terminal with a single write by flush_output
+#define OUTPUT_FLUSH_SIZE (1 << 20)
+
+struct {
+    size_t size;
+    size_t capacity;
+    char *data;
+} output;
+
+void flush_output() {
+    uint64_t start = stage_clock();
+    size_t written = 0;
+    while (written < output.size) {
+        ssize_t n = terminal.write(&output.data[written], output.size - written);
+        count_syscall(n > 0 ? n : 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            die("flush_output");
+        }
+        written += n;
+    }
+    output.size = 0;
+    record_stage(STAGE_FLUSH, start);
+}
+
+void write_bytes(const char *bytes, size_t length) {
+    if (output.size + length > output.capacity) {
+        // Very large dumps go out in pieces rather than growing the buffer without bound
+        if (output.size > 0 && output.size + length > OUTPUT_FLUSH_SIZE) flush_output();
+
+        size_t capacity = output.capacity ? output.capacity : 4096;
+        while (capacity < output.size + length) capacity *= 2;
+        output.data = realloc(output.data, capacity);
+        if (output.data == NULL) die("write_bytes");
+        output.capacity = capacity;
+    }
+
+    memcpy(&output.data[output.size], bytes, length);
+    output.size += length;
+}
+
+void write_char(char c) {
+    write_bytes(&c, 1);
+}
+
+void write_string(const char *string) {
+    write_bytes(string, strlen(string));
+}
+
+// Writes the contents of row from index to the end, skipping over the gap
+void write_row_from(struct row *row, size_t index) {
+    if (index < row->gap) {
+        write_bytes(&row->data[index], row->gap - index);
+        index = row->gap;
+    }
+    write_bytes(&row->data[gap_end(row) + index - row->gap], row->size - index);
+}
+
+void write_row(struct row *row) {
+    write_row_from(row, 0);
+}
+
+void clear_screen() {
+    write_string("\x1b[2J");
+    write_string("\x1b[1;1H");
+}
+
+/* Terminal manipulation */
+
+// Puts value in dest in decimal and returns how many digits that took, at most 10
+int format_number(char *dest, unsigned value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    for (int i = 0; i < count; i++) {
+        dest[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+// Row and column count from 1, and the whole sequence goes out in one piece
+void move_cursor(int row, int column) {
+    char sequence[32] = "\x1b[";
+    int length = 2;
+    length += format_number(&sequence[length], row);
+    sequence[length++] = ';';
+    length += format_number(&sequence[length], column);
+    sequence[length++] = 'H';
+    write_bytes(sequence, length);
+}
+
+// Moves the contents of terminal lines top to bottom up by count lines, or
+// down for a negative count, leaving blank lines behind. Everything outside
+// them stays where it is
+void scroll_lines(int top, int bottom, int count) {
+    char sequence[64] = "\x1b[";
+    int length = 2;
+    length += format_number(&sequence[length], top);
+    sequence[length++] = ';';
+    length += format_number(&sequence[length], bottom);
+    memcpy(&sequence[length], "r\x1b[", 3);
+    length += 3;
+    length += format_number(&sequence[length], count > 0 ? count : -count);
+    sequence[length++] = count > 0 ? 'S' : 'T';
+    memcpy(&sequence[length], "\x1b[r", 3);
+    length += 3;
+    write_bytes(sequence, length);
+}
+
+/* Screen */
+
+// Room for a screen line with a colour change and a cursor before every
+// character, and then some for characters that take up no columns
+#define LINE_BYTES(cols) ((cols) * 32 + 64)
+
+// What is currently on the terminal, one line per screen row, so each frame
+// only redraws the lines that changed
+struct frame_line {
+    size_t size;
+    char *data;
+};
+
+struct {
+    int rows;
+    int cols;
+    size_t row_offset;          // Document row shown at the top of the screen
+    size_t col_offset;          // Column of each row shown in the first column, unless wrapping
+    bool wrap;                  // Long rows are broken into visual lines instead of scrolled sideways
+    size_t wrap_offset;         // Visual line of the top row shown at the top of the screen
+    int cursor_y;               // Where the cursor is on screen, worked out by scroll_to_cursor
+    size_t cursor_x;
+    bool shown;                 // Whether the last frame's viewport below can be scrolled from
+    size_t shown_row;
+    size_t shown_line;
+    size_t shown_col;
+    struct frame_line *lines;
+    char *scratch;
+    char message[256];          // Shown on the bottom line
+
+    // The extra cursors on the row being formatted, which are drawn in reverse video
+    const struct cursor *marks;
+    size_t n_marks;
+    size_t marked_size;         // That row's size, as a cursor at its end is drawn over a space
+} screen;
+
+// The bottom line of the screen is kept for messages
+int text_rows() {
+    return screen.rows > 1 ? screen.rows - 1 : 1;
+}
+
+void set_message(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(screen.message, sizeof(screen.message), format, args);
+    va_end(args);
+}
+
+// Forgets the previous frame so that the next render redraws every line
+void invalidate_screen() {
+    screen.shown = false;
+    for (int y = 0; y < screen.rows; y++) {
+        screen.lines[y].size = SIZE_MAX;
+    }
+}
+
+// Sizes the frame to the terminal and clears it, so the frame starts out blank
+void size_screen() {
+    for (int y = 0; y < screen.rows; y++) {
+        free(screen.lines[y].data);
+    }
+    free(screen.lines);
+    free(screen.scratch);
+
+    terminal.get_size(&screen.rows, &screen.cols);
+    screen.shown = false;
+    screen.lines = malloc(screen.rows * sizeof(struct frame_line));
+    screen.scratch = malloc(LINE_BYTES(screen.cols));
+    if (screen.lines == NULL || screen.scratch == NULL) die("size_screen");
+
+    for (int y = 0; y < screen.rows; y++) {
+        screen.lines[y].data = malloc(LINE_BYTES(screen.cols));
+        if (screen.lines[y].data == NULL) die("size_screen");
+        screen.lines[y].size = 0;
+    }
+
+    clear_screen();
+}
+
+void init_screen() {
+    screen.rows = 0;
+    screen.lines = NULL;
+    screen.scratch = NULL;
+    screen.row_offset = 0;
+    screen.col_offset = 0;
+    screen.wrap = true;
+    screen.wrap_offset = 0;
+    screen.shown = false;
+    screen.message[0] = '\0';
+    size_screen();
+
+    write_string("\x1b[?2004h");        // Bracketed paste
+}
+
+size_t visual_lines(struct row *row) {
+    return row_wraps(row, screen.cols)->count + 1;
+}
+
+size_t line_start(struct row *row, size_t line) {
+    return line == 0 ? 0 : row_wraps(row, screen.cols)->starts[line - 1];
+}
+
+size_t line_end(struct row *row, size_t line) {
+    struct wraps *wraps = row_wraps(row, screen.cols);
+    return line < wraps->count ? wraps->starts[line] : row->size;
+}
+
+// Visual line of row that byte index is shown on; a break belongs to the line it starts
+size_t line_of(struct row *row, size_t index) {
+    struct wraps *wraps = row_wraps(row, screen.cols);
+    size_t low = 0;
+    size_t high = wraps->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (wraps->starts[middle] <= index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Steps (*y, *line) one visual line up or down, returning false at either end of the document
+bool step_line(size_t *y, size_t *line, int direction) {
+    if (direction < 0) {
+        if (*line > 0) {
+            (*line)--;
+        } else if (*y > 0) {
+            (*y)--;
+            *line = visual_lines(get_row(*y)) - 1;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if (*line + 1 < visual_lines(get_row(*y))) {
+        (*line)++;
+        return true;
+    }
+    index_rows(*y + 2);
+    if (*y + 1 >= row_count()) return false;
+    (*y)++;
+    *line = 0;
+    return true;
+}
+
+// Scrolls by visual lines, counting no further than a screen's worth between
+// the top and the cursor, so wrapping never has to look at the whole document
+void scroll_wrapped() {
+    struct row *row = get_row(buffer->cy);
+    size_t line = line_of(row, buffer->cx);
+    screen.col_offset = 0;
+    screen.cursor_x = column_of(row, buffer->cx) - column_of(row, line_start(row, line));
+
+    if (buffer->cy < screen.row_offset || (buffer->cy == screen.row_offset && line <= screen.wrap_offset)) {
+        screen.row_offset = buffer->cy;
+        screen.wrap_offset = line;
+        screen.cursor_y = 0;
+        return;
+    }
+
+    // Edits and resizes can leave the top row with fewer visual lines than before
+    size_t lines = visual_lines(get_row(screen.row_offset));
+    if (screen.wrap_offset >= lines) screen.wrap_offset = lines - 1;
+
+    size_t y = screen.row_offset;
+    size_t top_line = screen.wrap_offset;
+    int distance = 0;
+    while ((y != buffer->cy || top_line != line) && distance < text_rows()) {
+        step_line(&y, &top_line, 1);
+        distance++;
+    }
+    if (distance < text_rows()) {
+        screen.cursor_y = distance;
+        return;
+    }
+
+    // The cursor went off the bottom, so it goes on the last line
+    y = buffer->cy;
+    top_line = line;
+    for (distance = 0; distance < text_rows() - 1 && step_line(&y, &top_line, -1); distance++) {}
+    screen.row_offset = y;
+    screen.wrap_offset = top_line;
+    screen.cursor_y = distance;
+}
+
+void scroll_to_cursor() {
+    if (screen.wrap) {
+        scroll_wrapped();
+        return;
+    }
+
+    if (buffer->cy < screen.row_offset) screen.row_offset = buffer->cy;
+    if (buffer->cy >= screen.row_offset + text_rows()) screen.row_offset = buffer->cy - text_rows() + 1;
+
+    // The whole of a wide character under the cursor has to be visible
+    struct row *row = get_row(buffer->cy);
+    size_t column = column_of(row, buffer->cx);
+    size_t end = column + 1;
+    if (buffer->cx < row->size) {
+        uint32_t code;
+        row_decode(row, buffer->cx, &code);
+        if (char_width(code) > 1) end = column + char_width(code);
+    }
+    if (column < screen.col_offset) screen.col_offset = column;
+    if (end > screen.col_offset + screen.cols) screen.col_offset = end - screen.cols;
+
+    screen.cursor_y = buffer->cy - screen.row_offset;
+    screen.cursor_x = column - screen.col_offset;
+}
+
+// A one-line text field on the message line, used for things like the search query
+struct {
+    bool active;
+    const char *label;
+    size_t length;
+    char text[QUERY_SIZE];
+    void (*done)(const char *text);
+} prompt;
+
+void start_prompt(const char *label, void (*done)(const char *text)) {
+    prompt.active = true;
+    prompt.label = label;
+    prompt.length = 0;
+    prompt.text[0] = '\0';
+    prompt.done = done;
+}
+
+void handle_prompt_key(int c) {
+    if (c == KEY_ENTER) {
+        prompt.active = false;
+        set_message("");
+        prompt.done(prompt.text);
+    } else if (c == KEY_ESCAPE || c == CTRL_PLUS('q')) {
+        prompt.active = false;
+        set_message("");
+    } else if (c == KEY_BACKSPACE) {
+        while (prompt.length > 0 && (prompt.text[--prompt.length] & 0xc0) == 0x80) {}
+        prompt.text[prompt.length] = '\0';
+    } else if (((c < 128 && isprint(c)) || (c >= 128 && c < 256)) && prompt.length < QUERY_SIZE - 1) {
+        prompt.text[prompt.length++] = c;
+        prompt.text[prompt.length] = '\0';
+    }
+}
+
+// Puts size bytes on screen row y, where they take up width columns, unless
+// that is what the last frame already shows there
+void draw_line(int y, const char *bytes, size_t size, size_t width, bool *hidden) {
+    struct frame_line *line = &screen.lines[y];
+    if (line->size == size && memcmp(line->data, bytes, size) == 0) return;
+
+    if (!*hidden) {
+        write_string("\x1b[?25l");
+        *hidden = true;
+    }
+    move_cursor(y + 1, 1);
+    write_bytes(bytes, size);
+    if (width < (size_t)screen.cols) write_string("\x1b[0K");
+
+    memcpy(line->data, bytes, size);
+    line->size = size;
+}
+
+void append_scratch(size_t *size, const char *bytes, size_t length) {
+    memcpy(&screen.scratch[*size], bytes, length);
+    *size += length;
+}
+
+// Picks out the extra cursors on row y for format_span
+void mark_cursors(struct row *row, size_t y) {
+    size_t low = 0;
+    size_t high = buffer->n_cursors;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (buffer->cursors[middle].y < y) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    size_t end = low;
+    while (end < buffer->n_cursors && buffer->cursors[end].y == y) end++;
+    screen.marks = &buffer->cursors[low];
+    screen.n_marks = end - low;
+    screen.marked_size = row->size;
+}
+
+// Gets the first end bytes of row in one piece and, if the buffer is
+// highlighted, their classes in highlighter.classes
+const char *lex_visible(struct row *row, size_t end) {
+    // The row is lexed from its start, since what is visible depends on what came before
+    const char *line = highlight_line(row, end);
+    if (buffer->highlight) lex_row(line, end, row->hl_start, highlighter.classes);
+    return line;
+}
+
+// Puts bytes start to end of a line from lex_visible into screen.scratch, after
+// a space if pad is set, and returns their size. *width gets their size on screen
+size_t format_span(const char *line, size_t start, size_t end, bool pad, size_t *width) {
+    size_t size = 0;
+    *width = 0;
+    if (pad) {
+        screen.scratch[size++] = ' ';
+        *width += 1;
+    }
+
+    const struct cursor *mark = screen.marks;
+    const struct cursor *marks_end = &screen.marks[screen.n_marks];
+    while (mark < marks_end && mark->x < start) mark++;
+
+    int class = HL_PLAIN;
+    size_t i = start;
+    while (i < end && size + 32 <= LINE_BYTES(screen.cols)) {
+        if (buffer->highlight && highlighter.classes[i] != class) {
+            class = highlighter.classes[i];
+            append_scratch(&size, hl_colors[class], strlen(hl_colors[class]));
+        }
+
+        bool marked = mark < marks_end && mark->x == i;
+        if (marked) {
+            append_scratch(&size, "\x1b[7m", 4);
+            mark++;
+        }
+
+        uint32_t code;
+        size_t length = decode_utf8((const unsigned char *)&line[i], end - i, &code);
+        if (code == REPLACEMENT_CHARACTER && length == 1) {
+            append_scratch(&size, "\xef\xbf\xbd", 3);
+        } else {
+            append_scratch(&size, &line[i], length);
+        }
+        if (marked) append_scratch(&size, "\x1b[27m", 5);
+        *width += char_width(code);
+        i += length;
+    }
+    if (class != HL_PLAIN) append_scratch(&size, hl_colors[HL_PLAIN], strlen(hl_colors[HL_PLAIN]));
+
+    if (i == screen.marked_size && mark < marks_end && mark->x == i && *width < (size_t)screen.cols) {
+        append_scratch(&size, "\x1b[7m \x1b[27m", 10);
+        *width += 1;
+    }
+
+    return size;
+}
+
+// Puts the part of row scrolled into view into screen.scratch and returns its size
+size_t format_row(struct row *row, size_t *width) {
+    size_t column, end_column;
+    size_t start = byte_at_column(row, screen.col_offset, &column);
+    size_t end = byte_at_column(row, screen.col_offset + screen.cols, &end_column);
+    const char *line = lex_visible(row, end);
+
+    // A wide character straddling the left edge has a space stand in for its visible half
+    bool pad = column < screen.col_offset && start < end;
+    if (pad) start = next_char(row, start);
+    return format_span(line, start, end, pad, width);
+}
+
+void draw_wrapped(bool *hidden) {
+    size_t index = screen.row_offset;
+    size_t line = screen.wrap_offset;
+    int y = 0;
+    while (y < text_rows()) {
+        if (index >= row_count()) {
+            draw_line(y++, screen.scratch, 0, 0, hidden);
+            continue;
+        }
+
+        // Every visual line of a row that is on screen comes out of one pass of the lexer
+        struct row *row = get_row(index);
+        mark_cursors(row, index);
+        size_t last = line + (text_rows() - y) - 1;
+        if (last >= visual_lines(row)) last = visual_lines(row) - 1;
+        const char *text = lex_visible(row, line_end(row, last));
+        for (; line <= last; line++) {
+            size_t width;
+            size_t size = format_span(text, line_start(row, line), line_end(row, line), false, &width);
+            draw_line(y++, screen.scratch, size, width, hidden);
+        }
+
+        index++;
+        line = 0;
+    }
+}
+
+void slide_window();
+
+// Visual lines from the top of the last frame down to the top of this one,
+// negative if it moved up, and 0 if they are a screen or more apart
+int scroll_distance() {
+    if (!screen.shown || screen.shown_col != screen.col_offset || screen.shown_row >= row_count()) return 0;
+
+    size_t y = screen.shown_row;
+    size_t line = screen.wrap ? screen.shown_line : 0;
+    size_t end_y = screen.row_offset;
+    size_t end_line = screen.wrap ? screen.wrap_offset : 0;
+    int direction = 1;
+    if (end_y < y || (end_y == y && end_line < line)) {
+        direction = -1;
+        if (y - end_y >= (size_t)text_rows()) return 0;
+    } else if (end_y - y >= (size_t)text_rows()) {
+        return 0;
+    }
+
+    int distance = 0;
+    while ((y != end_y || line != end_line) && distance < text_rows()) {
+        if (!step_line(&y, &line, direction)) return 0;
+        distance++;
+    }
+    return distance < text_rows() ? direction * distance : 0;
+}
+
+// Scrolls the text lines on the terminal and in the last frame alike, so only
+// the lines that scroll into view have to be drawn
+void scroll_frame(bool *hidden) {
+    int distance = scroll_distance();
+    screen.shown = true;
+    screen.shown_row = screen.row_offset;
+    screen.shown_line = screen.wrap_offset;
+    screen.shown_col = screen.col_offset;
+    if (distance == 0) return;
+
+    if (!*hidden) {
+        write_string("\x1b[?25l");
+        *hidden = true;
+    }
+    int rows = text_rows();
+    scroll_lines(1, rows, distance);
+
+    // Rotate the lines rather than copy them, each one owns its buffer
+    int count = distance > 0 ? distance : -distance;
+    struct frame_line moved[count];
+    if (distance > 0) {
+        memcpy(moved, screen.lines, count * sizeof(struct frame_line));
+        memmove(screen.lines, &screen.lines[count], (rows - count) * sizeof(struct frame_line));
+        memcpy(&screen.lines[rows - count], moved, count * sizeof(struct frame_line));
+        for (int y = rows - count; y < rows; y++) screen.lines[y].size = 0;
+    } else {
+        memcpy(moved, &screen.lines[rows - count], count * sizeof(struct frame_line));
+        memmove(&screen.lines[count], screen.lines, (rows - count) * sizeof(struct frame_line));
+        memcpy(screen.lines, moved, count * sizeof(struct frame_line));
+        for (int y = 0; y < count; y++) screen.lines[y].size = 0;
+    }
+}
+
+// Draws the visible part of the buffer, emitting only lines that differ from the last frame
+void render() {
+    if (buffer->streaming) slide_window();
+    scroll_to_cursor();
+    index_rows(screen.row_offset + text_rows());
+
+    bool hidden = false;
+    scroll_frame(&hidden);
+    if (screen.wrap) {
+        draw_wrapped(&hidden);
+    } else {
+        for (int y = 0; y < text_rows(); y++) {
+            size_t index = screen.row_offset + y;
+            size_t size = 0;
+            size_t width = 0;
+            if (index < row_count()) {
+                mark_cursors(get_row(index), index);
+                size = format_row(get_row(index), &width);
+            }
+            draw_line(y, screen.scratch, size, width, &hidden);
+        }
+    }
+    if (buffer->highlight && buffer->highlighted < screen.row_offset + text_rows() && buffer->highlighted < row_count()) {
+        schedule_highlight(screen.row_offset + text_rows());
+    }
+
+    if (prompt.active) set_message("%s%s", prompt.label, prompt.text);
+    size_t width;
+    size_t size = fit_text(screen.message, strlen(screen.message), screen.cols, &width);
+    draw_line(screen.rows - 1, screen.message, size, width, &hidden);
+
+    if (prompt.active) {
+        move_cursor(screen.rows, width + 1);
+    } else {
+        move_cursor(screen.cursor_y + 1, screen.cursor_x + 1);
+    }
+    if (hidden) write_string("\x1b[?25h");
+}
+
+/* Buffers */
+
+// Shows buffer index in place of the one on screen, which keeps its scroll position
+void switch_buffer(size_t index) {
+    if (buffer != NULL) {
+        buffer->row_offset = screen.row_offset;
+        buffer->col_offset = screen.col_offset;
+        buffer->wrap_offset = screen.wrap_offset;
+    }
+    forget_search();
+    screen.shown = false;
+
+    buffers.current = index;
+    buffer = buffers.list[index];
+    screen.row_offset = buffer->row_offset;
+    screen.col_offset = buffer->col_offset;
+    screen.wrap_offset = buffer->wrap_offset;
+}
+
+// Adds an empty buffer after the others and shows it
+void new_buffer() {
+    if (buffers.count == buffers.capacity) {
+        buffers.capacity = buffers.capacity ? buffers.capacity * 2 : 8;
+        buffers.list = realloc(buffers.list, buffers.capacity * sizeof(struct buffer *));
+        if (buffers.list == NULL) die("new_buffer");
+    }
+
+    struct buffer *created = calloc(1, sizeof(struct buffer));
+    if (created == NULL) die("new_buffer");
+    buffers.list[buffers.count++] = created;
+    switch_buffer(buffers.count - 1);
+    reset_buffer();
+}
+
+// Closes the buffer on screen and shows the one before it. The last buffer
+// left is only emptied, so there is always one to show
+void kill_buffer() {
+    forget_search();
+    if (buffers.count == 1) {
+        close_buffer();
+        return;
+    }
+
+    release_buffer();
+    free(buffer->journal.edits);
+    free(buffer);
+    size_t index = buffers.current;
+    memmove(&buffers.list[index], &buffers.list[index + 1], (buffers.count - index - 1) * sizeof(struct buffer *));
+    buffers.count--;
+
+    buffer = NULL;
+    switch_buffer(index > 0 ? index - 1 : 0);
+}
+
+void show_buffer_name() {
+    set_message("%s (%zu of %zu)", buffer->filename != NULL ? buffer->filename : "[new]",
+                buffers.current + 1, buffers.count);
+}
+
+void open_buffer(const char *filename) {
+    if (filename[0] == '\0') return;
+
+    size_t previous = buffers.current;
+    new_buffer();
+    if (open_file(filename)) {
+        show_buffer_name();
+        return;
+    }
+
+    set_message("Can't open %s: %s", filename, strerror(errno));
+    kill_buffer();
+    switch_buffer(previous);
+}
+
+void init_buffer() {
+    new_buffer();
+}
+
+/* Large files */
+
+// A streamed file only has rows for the lines around the cursor. The window
+// is loaded ahead as the cursor moves and dropped behind it, and jumping far
+// away starts a new one, so memory doesn't depend on how big the file is
+#define WINDOW_ROWS 65536           // Rows kept on either side of the cursor
+#define WINDOW_MARGIN 1024          // Rows loaded above the cursor ahead of time
+
+// Loads up to count of the lines before the window in front of it
+size_t prepend_rows(size_t count) {
+    size_t added = 0;
+    size_t end = buffer->window_start;
+    while (added < count && end > 0) {
+        const char *newline = end > 1 ? memrchr(buffer->map, '\n', end - 1) : NULL;
+        size_t start = newline != NULL ? newline - buffer->map + 1 : 0;
+        borrow_row(insert_row(0), &buffer->map[start], end - 1 - start);
+        end = start;
+        added++;
+    }
+    buffer->window_start = end;
+    return added;
+}
+
+// Drops the first count rows, which are still borrowed from the mapping as
+// only pinned windows are ever edited
+void drop_rows_above(size_t count) {
+    buffer->window_start = get_row(count)->data - buffer->map;
+    for (size_t i = 0; i < count; i++) remove_row(0);
+}
+
+// Drops rows from the end until count are left, to be indexed again later
+void drop_rows_below(size_t count) {
+    buffer->indexed = get_row(count)->data - buffer->map;
+    while (row_count() > count) remove_row(row_count() - 1);
+}
+
+// Keeps the window around the cursor. Row numbers change under the search
+// results when it moves, so they are thrown away, and nothing moves while a
+// search runs or there are other cursors to keep in it
+void slide_window() {
+    if (buffer->pinned || search.running || buffer->n_cursors > 0) return;
+
+    size_t moved = 0;
+    if (buffer->cy < WINDOW_MARGIN && buffer->window_start > 0) {
+        size_t added = prepend_rows(WINDOW_MARGIN);
+        buffer->cy += added;
+        screen.row_offset += added;
+        screen.shown_row += added;
+        moved += added;
+    }
+    if (buffer->cy > 2 * WINDOW_ROWS) {
+        size_t dropped = buffer->cy - WINDOW_ROWS;
+        drop_rows_above(dropped);
+        buffer->cy -= dropped;
+        screen.row_offset -= dropped;
+        screen.shown_row -= dropped;
+        moved += dropped;
+    }
+    if (row_count() > buffer->cy + 2 * WINDOW_ROWS) {
+        drop_rows_below(buffer->cy + WINDOW_ROWS);
+        moved++;
+    }
+    if (moved > 0) forget_search();
+}
+
+// Starts a new window at offset, which has to be where a line starts
+void jump_window(size_t offset) {
+    forget_search();
+    free_tree(buffer->root);
+    buffer->root = new_node(true);
+    buffer->highlighted = 0;
+    buffer->window_start = offset;
+    buffer->indexed = offset;
+    index_rows(0);
+
+    buffer->cy = 0;
+    buffer->cx = 0;
+    buffer->n_cursors = 0;
+    screen.row_offset = 0;
+    screen.wrap_offset = 0;
+    screen.shown = false;
+}
+
+// Moves the cursor to line, counting from 0. In a streamed file it has to be
+// inside a pinned window, or in a stripe that has been counted
+void go_to_line(size_t line) {
+    if (!buffer->streaming) {
+        index_rows(line + 1);
+        buffer->cy = line < row_count() ? line : row_count() - 1;
+        buffer->cx = 0;
+        return;
+    }
+
+    struct mapping *mapping = buffer->mapping;
+    // A pinned window grows downwards like any document, but not by more than a window's worth at a time
+    if (buffer->pinned) {
+        size_t first = line_at(mapping, buffer->window_start);
+        if (first != SIZE_MAX && line >= first && line - first < row_count() + WINDOW_ROWS) index_rows(line - first + 1);
+        if (first == SIZE_MAX || line < first || line - first >= row_count()) {
+            set_message("Only lines near the edited part of this file can be reached");
+            return;
+        }
+        buffer->cy = line - first;
+        buffer->cx = 0;
+        return;
+    }
+
+    size_t offset = line_offset(mapping, line);
+    if (offset == SIZE_MAX) {
+        set_message("Still counting lines, %zu%% done", mapping->counted * 100 / mapping->n_stripes);
+        return;
+    }
+    jump_window(offset);
+}
+
+// Moves the cursor to the line percent of the way through the file by bytes,
+// so only the rows up to there have to be split off, and streamed files don't
+// need their lines counted
+void go_to_percent(size_t percent) {
+    if (percent > 100) percent = 100;
+    if (!buffer->streaming) {
+        size_t offset = (node_bytes(buffer->root) + buffer->map_size - buffer->indexed) * percent / 100;
+        while (!fully_indexed() && node_bytes(buffer->root) <= offset) index_rows(row_count() + INDEX_CHUNK_ROWS);
+        buffer->cy = row_at_offset(&offset);
+        buffer->cx = 0;
+        return;
+    }
+    if (buffer->pinned) {
+        set_message("Only lines near the edited part of this file can be reached");
+        return;
+    }
+
+    size_t offset = buffer->map_size / 100 * percent;
+    if (offset >= buffer->map_size) offset = buffer->map_size - 1;
+    const char *newline = offset > 0 ? memrchr(buffer->map, '\n', offset) : NULL;
+    jump_window(newline != NULL ? newline - buffer->map + 1 : 0);
+}
+
+// Takes a line number counting from 1, or a percentage ending in %
+void go_to(const char *text) {
+    char *end;
+    size_t number = strtoull(text, &end, 10);
+    if (end == text || (*end != '\0' && strcmp(end, "%") != 0)) {
+        set_message("Not a line number: %s", text);
+        return;
+    }
+
+    if (*end == '%') {
+        go_to_percent(number);
+    } else {
+        go_to_line(number > 0 ? number - 1 : 0);
+    }
+}
+
+/* Processing */
+
+#define INPUT_BUFFER_SIZE 65536
+
+// Bytes read from the terminal that have not been decoded into keys yet
+struct {
+    size_t size;
+    char data[INPUT_BUFFER_SIZE];
+    bool pasting;
+} input;
+
+// The text of a bracketed paste, collected across as many reads as it takes
+struct {
+    size_t size;
+    size_t capacity;
+    char *data;
+} paste;
+
+void append_paste(const char *bytes, size_t length) {
+    if (paste.size + length > paste.capacity) {
+        size_t capacity = paste.capacity ? paste.capacity : INPUT_BUFFER_SIZE;
+        while (capacity < paste.size + length) capacity *= 2;
+        paste.data = realloc(paste.data, capacity);
+        if (paste.data == NULL) die("append_paste");
+        paste.capacity = capacity;
+    }
+
+    memcpy(&paste.data[paste.size], bytes, length);
+    paste.size += length;
+}
+
+// Escape sequences are looked up in a trie, a byte at a time, so a sequence
+// that a read cut short is known to be one and waited on
+#define MAX_SEQUENCE_NODES 64
+
+struct {
+    int n_nodes;
+    unsigned char next[MAX_SEQUENCE_NODES][128];    // Child for each byte, 0 for none as the root is no one's
+    int keys[MAX_SEQUENCE_NODES];                   // What the sequence ending here means, or KEY_NONE
+} sequences = { .n_nodes = 1, .keys = { KEY_NONE } };
+
+void add_sequence(const char *sequence, int key) {
+    int node = 0;
+    for (const char *c = sequence; *c != '\0'; c++) {
+        if (sequences.next[node][(unsigned char)*c] == 0) {
+            if (sequences.n_nodes == MAX_SEQUENCE_NODES) die("add_sequence");
+            sequences.keys[sequences.n_nodes] = KEY_NONE;
+            sequences.next[node][(unsigned char)*c] = sequences.n_nodes++;
+        }
+        node = sequences.next[node][(unsigned char)*c];
+    }
+    sequences.keys[node] = key;
+}
+
+void init_sequences() {
+    add_sequence("\x1b[A", KEY_UP);
+    add_sequence("\x1b[B", KEY_DOWN);
+    add_sequence("\x1b[C", KEY_RIGHT);
+    add_sequence("\x1b[D", KEY_LEFT);
+    add_sequence("\x1b[H", KEY_HOME);
+    add_sequence("\x1b[F", KEY_END);
+    add_sequence("\x1b[1~", KEY_HOME);
+    add_sequence("\x1b[4~", KEY_END);
+    add_sequence("\x1bOA", KEY_UP);
+    add_sequence("\x1bOB", KEY_DOWN);
+    add_sequence("\x1bOC", KEY_RIGHT);
+    add_sequence("\x1bOD", KEY_LEFT);
+    add_sequence("\x1bOH", KEY_HOME);
+    add_sequence("\x1bOF", KEY_END);
+    add_sequence("\x1b[200~", KEY_PASTE_START);
+}
+
+// Decodes the key at the start of bytes and returns how many bytes it used,
+// or 0 if bytes ends partway through an escape sequence
+size_t decode_key(const char *bytes, size_t length, int *key) {
+    if (bytes[0] != '\x1b') {
+        *key = (unsigned char)bytes[0];
+        return 1;
+    }
+
+    int node = 0;
+    size_t i = 0;
+    while (i < length && (unsigned char)bytes[i] < 128 && sequences.next[node][(unsigned char)bytes[i]] != 0) {
+        node = sequences.next[node][(unsigned char)bytes[i++]];
+        if (sequences.keys[node] != KEY_NONE) {
+            *key = sequences.keys[node];
+            return i;
+        }
+    }
+    if (i == length) return 0;
+
+    if (bytes[1] != '[' && bytes[1] != 'O') {
+        *key = KEY_ESCAPE;
+        return 1;
+    }
+
+    // Any other CSI or SS3 sequence is skipped: parameter and intermediate bytes, then a final byte
+    i = 2;
+    while (i < length && bytes[i] >= 0x20 && bytes[i] <= 0x3f) i++;
+    if (i == length) return 0;
+    *key = KEY_NONE;
+    return i + 1;
+}
+
+// Decodes every complete key in the input buffer into keys and returns how
+// many there were. With flush set, a trailing partial escape sequence is
+// taken as a bare escape instead of waiting for the rest of it
+size_t decode_keys(int *keys, size_t max, bool flush) {
+    size_t count = 0;
+    size_t start = 0;
+
+    while (start < input.size && count < max) {
+        if (input.pasting) {
+            const char *end = memmem(&input.data[start], input.size - start, PASTE_END, strlen(PASTE_END));
+
+            // Hold back anything that could be the start of a split end marker
+            size_t stop = end != NULL ? (size_t)(end - input.data) : input.size;
+            if (end == NULL && stop - start < strlen(PASTE_END)) break;
+            if (end == NULL) stop -= strlen(PASTE_END) - 1;
+
+            append_paste(&input.data[start], stop - start);
+            start = stop;
+            if (end == NULL) break;
+
+            start += strlen(PASTE_END);
+            input.pasting = false;
+
+            // There is only one paste buffer, so it has to be handled before decoding on
+            keys[count++] = KEY_PASTE;
+            break;
+        }
+
+        int key;
+        size_t used = decode_key(&input.data[start], input.size - start, &key);
+        if (used == 0) {
+            if (!flush && input.size < INPUT_BUFFER_SIZE) break;
+            key = KEY_ESCAPE;
+            used = 1;
+        }
+        start += used;
+
+        if (key == KEY_PASTE_START) {
+            input.pasting = true;
+        } else if (key != KEY_NONE) {
+            keys[count++] = key;
+        }
+    }
+
+    memmove(input.data, &input.data[start], input.size - start);
+    input.size -= start;
+    return count;
+}
+
+// Moves the cursor a visual line up or down, as close to the column it was at on screen as that line allows
+void move_visual(int direction) {
+    struct row *row = get_row(buffer->cy);
+    size_t line = line_of(row, buffer->cx);
+    size_t column = column_of(row, buffer->cx) - column_of(row, line_start(row, line));
+
+    size_t y = buffer->cy;
+    if (!step_line(&y, &line, direction)) return;
+    row = get_row(y);
+
+    size_t start = line_start(row, line);
+    size_t end = line_end(row, line);
+    size_t at;
+    size_t x = byte_at_column(row, column_of(row, start) + column, &at);
+
+    // The end of a line that wraps is the start of the next one, so stop a character short
+    if (x >= end && line + 1 < visual_lines(row)) x = previous_char(row, end);
+
+    buffer->cy = y;
+    buffer->cx = x;
+}
+
+// Moves the cursor to row y, as close to the column it was at as that row allows
+void move_to_row(size_t y) {
+    size_t column = column_of(get_row(buffer->cy), buffer->cx);
+    size_t start;
+    buffer->cy = y;
+    buffer->cx = byte_at_column(get_row(y), column, &start);
+}
+
+// Moves the cursor for an arrow key
+void move_by_key(int c) {
+    if (c == KEY_LEFT) {
+        if (buffer->cx > 0) buffer->cx = previous_char(get_row(buffer->cy), buffer->cx);
+    } else if (c == KEY_RIGHT) {
+        if (buffer->cx < get_row(buffer->cy)->size) buffer->cx = next_char(get_row(buffer->cy), buffer->cx);
+    } else if (c == KEY_UP && screen.wrap) {
+        move_visual(-1);
+    } else if (c == KEY_DOWN && screen.wrap) {
+        move_visual(1);
+    } else if (c == KEY_UP) {
+        if (buffer->cy > 0) move_to_row(buffer->cy - 1);
+    } else if (c == KEY_DOWN) {
+        index_rows(buffer->cy + 2);
+        if (buffer->cy < row_count() - 1) move_to_row(buffer->cy + 1);
+    } else if (c == KEY_HOME) {
+        buffer->cx = 0;
+    } else if (c == KEY_END) {
+        buffer->cx = get_row(buffer->cy)->size;
+    }
+}
+
+// Moves every cursor for an arrow key, each of them as if it were the only one
+void move_cursors(int c) {
+    struct cursor own = { buffer->cy, buffer->cx };
+    for (size_t i = 0; i < buffer->n_cursors; i++) {
+        buffer->cy = buffer->cursors[i].y;
+        buffer->cx = buffer->cursors[i].x;
+        move_by_key(c);
+        buffer->cursors[i] = (struct cursor){ buffer->cy, buffer->cx };
+    }
+    buffer->cy = own.y;
+    buffer->cx = own.x;
+    move_by_key(c);
+    sort_cursors();
+}
+
+// Leaves a cursor behind and moves on to the same column of the next row
+void add_cursor_below() {
+    index_rows(buffer->cy + 2);
+    if (buffer->cy + 1 >= row_count()) return;
+    add_cursor();
+    move_to_row(buffer->cy + 1);
+    sort_cursors();
+    set_message("%zu cursors", buffer->n_cursors + 1);
+}
+
+// Leaves a cursor behind and moves on to the next match of the last search
+void add_cursor_at_match() {
+    if (search.query[0] == '\0') {
+        set_message("Search with Ctrl-F first");
+        return;
+    }
+    if ((search.stale || search.n_matches == 0) && !search.running) {
+        start_search(search.query);
+        return;
+    }
+
+    struct cursor own = { buffer->cy, buffer->cx };
+    if (!jump_to_match(own.y, own.x, true)) return;
+    size_t y = buffer->cy;
+    size_t x = buffer->cx;
+    buffer->cy = own.y;
+    buffer->cx = own.x;
+    add_cursor();
+    buffer->cy = y;
+    buffer->cx = x;
+    sort_cursors();
+    set_message("%zu cursors", buffer->n_cursors + 1);
+}
+
+/* Replace */
+
+// A replace all rewrites each row with matches in one pass over it, so it
+// costs a copy of those rows however many matches there are. It is journaled
+// as one entry whose text is this header, then count matches in document
+// order where they were before the replace, then the text each of them
+// matched one after another, then the replacement
+struct replace_header {
+    size_t count;
+    size_t replaced;            // Bytes the matches add up to
+    size_t length;              // Of the replacement
+};
+
+char replace_query[QUERY_SIZE];
+
+// Appends length bytes of src from index to row, which has room for them
+void append_span(struct row *row, struct row *src, size_t index, size_t length) {
+    copy_row(src, index, &row->data[row->gap], length);
+    row->gap += length;
+    row->size += length;
+}
+
+// Puts the replacement in place of every match going forward, or what the
+// matches were in place of the replacements going back
+void replace_matches(const char *text, bool forward) {
+    struct replace_header header;
+    memcpy(&header, text, sizeof(header));
+    const struct match *matches = (const struct match *)&text[sizeof(header)];
+    const char *matched = (const char *)&matches[header.count];
+    const char *replacement = &matched[header.replaced];
+
+    size_t i = 0;
+    while (i < header.count) {
+        size_t y = matches[i].y;
+        struct row *row = modify_row(y);
+        size_t size = row->size;
+        size_t end = i;
+        while (end < header.count && matches[end].y == y) {
+            size += forward ? header.length - matches[end].length : matches[end].length - header.length;
+            end++;
+        }
+
+        struct row rewritten;
+        init_row(&rewritten);
+        reserve_row(&rewritten, size);
+        rewritten.hl_start = row->hl_start;
+        rewritten.hl_end = row->hl_end;
+
+        // Going back, the matches before this one on the row have already
+        // moved it by what was added less what was removed
+        size_t copied = 0;
+        size_t added = 0;
+        size_t removed = 0;
+        for (; i < end; i++) {
+            const struct match *match = &matches[i];
+            size_t x = forward ? match->x : match->x - removed + added;
+            append_span(&rewritten, row, copied, x - copied);
+            if (forward) {
+                insert_bytes(&rewritten, rewritten.size, replacement, header.length);
+                copied = x + match->length;
+            } else {
+                insert_bytes(&rewritten, rewritten.size, matched, match->length);
+                copied = x + header.length;
+            }
+            matched += match->length;
+            added += header.length;
+            removed += match->length;
+        }
+        append_span(&rewritten, row, copied, row->size - copied);
+
+        free_row(row);
+        *row = rewritten;
+    }
+
+    if (header.count > 0) {
+        buffer->cy = matches[0].y;
+        buffer->cx = matches[0].x;
+    }
+}
+
+// Checks that a replace all read back from a swap file is whole, and that its
+// matches are in order and inside their rows
+bool replace_fits(const char *text, size_t length, bool forward) {
+    struct replace_header header;
+    if (length < sizeof(header)) return false;
+    memcpy(&header, text, sizeof(header));
+    if (header.count > (length - sizeof(header)) / sizeof(struct match)) return false;
+    size_t rest = length - sizeof(header) - header.count * sizeof(struct match);
+    if (header.replaced > rest || header.length != rest - header.replaced) return false;
+
+    size_t replaced = 0;
+    size_t y = 0;
+    size_t end = 0;             // Of the last match on row y
+    size_t added = 0;
+    size_t removed = 0;
+    for (size_t i = 0; i < header.count; i++) {
+        struct match match;
+        memcpy(&match, &text[sizeof(header) + i * sizeof(match)], sizeof(match));
+        if (i > 0 && match.y < y) return false;
+        if (i == 0 || match.y != y) {
+            y = match.y;
+            end = added = removed = 0;
+            index_rows(y + 2);
+            if (y >= row_count()) return false;
+        }
+
+        size_t size = get_row(y)->size;
+        if (match.x < end || match.length > header.replaced - replaced) return false;
+        size_t x = forward ? match.x : match.x - removed + added;
+        size_t span = forward ? match.length : header.length;
+        if (x > size || span > size - x) return false;
+
+        end = match.x + match.length;
+        replaced += match.length;
+        added += header.length;
+        removed += match.length;
+    }
+    return replaced == header.replaced;
+}
+
+// Replaces every match of the search that just finished with search.replacement
+void finish_replace() {
+    search.replacing = false;
+    if (search.n_matches == 0) return;
+
+    size_t count = search.n_matches;
+    size_t replaced = 0;
+    for (size_t i = 0; i < count; i++) {
+        replaced += search.matches[i].length;
+    }
+    struct replace_header header = { .count = count, .replaced = replaced, .length = strlen(search.replacement) };
+    size_t size = sizeof(header) + count * sizeof(struct match) + replaced + header.length;
+    char *text = malloc(size);
+    if (text == NULL) die("finish_replace");
+
+    memcpy(text, &header, sizeof(header));
+    memcpy(&text[sizeof(header)], search.matches, count * sizeof(struct match));
+    char *matched = &text[sizeof(header) + count * sizeof(struct match)];
+    for (size_t i = 0; i < count; i++) {
+        struct match *match = &search.matches[i];
+        matched += copy_row(get_row(match->y), match->x, matched, match->length);
+    }
+    memcpy(matched, search.replacement, header.length);
+
+    before_edit();
+    buffer->n_cursors = 0;
+    apply_edit(record_replace(true, text, size), true);
+    set_message("Replaced %zu matches of %s", count, search.query);
+}
+
+// Searches for the query the first prompt took, and replaces what it finds
+// once the pool has found all of it
+void replace_all(const char *replacement) {
+    before_edit();
+    snprintf(search.replacement, sizeof(search.replacement), "%s", replacement);
+    search.replacing = true;
+    start_search(replace_query);
+
+    // With a bad pattern, or every leaf done without the pool, it is over already
+    if (!search.running) search.replacing = false;
+}
+
+void ask_replacement(const char *query) {
+    if (query[0] == '\0') return;
+    snprintf(replace_query, sizeof(replace_query), "%s", query);
+    start_prompt("Replace with: ", replace_all);
+}
+
+/* Commands */
+
+// What keys do. Every command gets the key that ran it, and works at every
+// cursor when there is more than one
+
+void command_quit(int key) {
+    remove_swap_files();
+    clear_screen();
+    flush_output();
+    exit(EXIT_SUCCESS);
+}
+
+void command_save(int key) {
+    save_file();
+}
+
+void command_search(int key) {
+    start_prompt("Search: ", start_search);
+}
+
+void command_find_next(int key) {
+    find_next();
+}
+
+void command_follow(int key) {
+    toggle_follow();
+}
+
+void command_replace(int key) {
+    start_prompt("Replace: ", ask_replacement);
+}
+
+void command_go_to(int key) {
+    start_prompt("Go to line or %: ", go_to);
+}
+
+void command_open(int key) {
+    start_prompt("Open: ", open_buffer);
+}
+
+void command_next_buffer(int key) {
+    switch_buffer((buffers.current + 1) % buffers.count);
+    show_buffer_name();
+}
+
+void command_close_buffer(int key) {
+    kill_buffer();
+    show_buffer_name();
+}
+
+void command_wrap(int key) {
+    screen.wrap = !screen.wrap;
+    screen.col_offset = 0;
+    screen.wrap_offset = 0;
+    screen.shown = false;
+}
+
+void command_undo(int key) {
+    undo();
+}
+
+void command_redo(int key) {
+    redo();
+}
+
+void command_cursor_below(int key) {
+    add_cursor_below();
+}
+
+void command_cursor_at_match(int key) {
+    add_cursor_at_match();
+}
+
+void command_single_cursor(int key) {
+    buffer->n_cursors = 0;
+}
+
+void command_move(int key) {
+    if (buffer->n_cursors > 0) {
+        move_cursors(key);
+    } else {
+        move_by_key(key);
+    }
+}
+
+void command_newline(int key) {
+    if (buffer->n_cursors > 0) {
+        edit_cursors("\n", 1, false);
+        return;
+    }
+    edit_split_line(buffer->cy, buffer->cx);
+    buffer->cx = 0;
+    buffer->cy++;
+}
+
+void command_backspace(int key) {
+    if (buffer->n_cursors > 0) {
+        edit_cursors(NULL, 0, true);
+        return;
+    }
+
+    if (buffer->cx == 0 && buffer->cy == 0) return;
+    if (buffer->cx == 0) {
+        buffer->cx = get_row(buffer->cy - 1)->size;
+        edit_join_lines(buffer->cy);
+        buffer->cy--;
+    } else {
+        size_t start = previous_char(get_row(buffer->cy), buffer->cx);
+        while (buffer->cx > start) {
+            buffer->cx--;
+            edit_remove_char(buffer->cy, buffer->cx);
+        }
+    }
+}
+
+void command_paste(int key) {
+    if (buffer->n_cursors > 0) {
+        edit_cursors(paste.data, paste.size, false);
+    } else {
+        edit_insert_text(&buffer->cy, &buffer->cx, paste.data, paste.size);
+    }
+}
+
+// Types the key's byte. Multibyte characters arrive a byte at a time
+void command_insert(int key) {
+    char byte = key;
+    if (buffer->n_cursors > 0) {
+        edit_cursors(&byte, 1, false);
+        return;
+    }
+    edit_insert_char(buffer->cy, buffer->cx, byte);
+    buffer->cx++;
+}
+
+struct command {
+    const char *name;
+    void (*run)(int key);
+};
+
+const struct command commands[] = {
+    { "quit", command_quit },
+    { "save", command_save },
+    { "search", command_search },
+    { "find-next", command_find_next },
+    { "replace", command_replace },
+    { "follow", command_follow },
+    { "go-to", command_go_to },
+    { "open", command_open },
+    { "next-buffer", command_next_buffer },
+    { "close-buffer", command_close_buffer },
+    { "wrap", command_wrap },
+    { "undo", command_undo },
+    { "redo", command_redo },
+    { "cursor-below", command_cursor_below },
+    { "cursor-at-match", command_cursor_at_match },
+    { "single-cursor", command_single_cursor },
+    { "move", command_move },
+    { "newline", command_newline },
+    { "backspace", command_backspace },
+    { "paste", command_paste },
+    { "insert", command_insert },
+    { "none", NULL },
+};
+
+#define N_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+const struct command *find_command(const char *name, size_t length) {
+    for (size_t i = 0; i < N_COMMANDS; i++) {
+        if (strlen(commands[i].name) == length && memcmp(commands[i].name, name, length) == 0) return &commands[i];
+    }
+    return NULL;
+}
+
+// Runs a command as if key had been pressed, for callers that don't go through the keymap
+void run_command(const char *name, int key) {
+    const struct command *command = find_command(name, strlen(name));
+    if (command == NULL) die("run_command");
+    if (command->run != NULL) command->run(key);
+    if (key == KEY_PASTE) paste.size = 0;
+}
+
+/* Keymap */
+
+// The command each key runs, looked up straight from the key. EDITOR_KEYS can
+// rebind keys, as in EDITOR_KEYS="ctrl-w=follow ctrl-t=wrap"
+void (*keymap[N_KEYS])(int key);
+
+struct binding {
+    int key;
+    const char *command;
+};
+
+const struct binding default_bindings[] = {
+    { CTRL_PLUS('q'), "quit" },
+    { CTRL_PLUS('s'), "save" },
+    { CTRL_PLUS('f'), "search" },
+    { CTRL_PLUS('n'), "find-next" },
+    { CTRL_PLUS('r'), "replace" },
+    { CTRL_PLUS('t'), "follow" },
+    { CTRL_PLUS('g'), "go-to" },
+    { CTRL_PLUS('o'), "open" },
+    { CTRL_PLUS('b'), "next-buffer" },
+    { CTRL_PLUS('k'), "close-buffer" },
+    { CTRL_PLUS('w'), "wrap" },
+    { CTRL_PLUS('z'), "undo" },
+    { CTRL_PLUS('y'), "redo" },
+    { CTRL_PLUS('e'), "cursor-below" },
+    { CTRL_PLUS('d'), "cursor-at-match" },
+    { KEY_ESCAPE, "single-cursor" },
+    { KEY_ENTER, "newline" },
+    { KEY_BACKSPACE, "backspace" },
+    { KEY_LEFT, "move" },
+    { KEY_RIGHT, "move" },
+    { KEY_UP, "move" },
+    { KEY_DOWN, "move" },
+    { KEY_HOME, "move" },
+    { KEY_END, "move" },
+    { KEY_PASTE, "paste" },
+};
+
+struct key_name {
+    const char *name;
+    int key;
+};
+
+const struct key_name key_names[] = {
+    { "enter", KEY_ENTER },
+    { "escape", KEY_ESCAPE },
+    { "backspace", KEY_BACKSPACE },
+    { "tab", '\t' },
+    { "space", ' ' },
+    { "left", KEY_LEFT },
+    { "right", KEY_RIGHT },
+    { "up", KEY_UP },
+    { "down", KEY_DOWN },
+    { "home", KEY_HOME },
+    { "end", KEY_END },
+};
+
+// Takes ctrl-x, a key named in key_names or a single character, and returns KEY_NONE for anything else
+int parse_key(const char *name, size_t length) {
+    if (length == 6 && memcmp(name, "ctrl-", 5) == 0 && isalpha((unsigned char)name[5])) return CTRL_PLUS(name[5]);
+    if (length == 1) return (unsigned char)name[0];
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        if (strlen(key_names[i].name) == length && memcmp(key_names[i].name, name, length) == 0) return key_names[i].key;
+    }
+    return KEY_NONE;
+}
+
+// Applies key=command pairs separated by spaces, stopping at the first one that makes no sense
+void bind_keys(const char *text) {
+    const char *pair = text;
+    while (*pair != '\0') {
+        size_t length = strcspn(pair, " ");
+        const char *equals = memchr(pair, '=', length);
+        int key = equals != NULL ? parse_key(pair, equals - pair) : KEY_NONE;
+        const struct command *command = equals != NULL ? find_command(equals + 1, pair + length - equals - 1) : NULL;
+        if (length > 0 && (key == KEY_NONE || command == NULL)) {
+            set_message("Can't bind %.*s", (int)length, pair);
+            return;
+        }
+        if (length > 0) keymap[key] = command->run;
+
+        pair += length;
+        while (*pair == ' ') pair++;
+    }
+}
+
+void init_keymap() {
+    init_sequences();
+    for (int c = 0; c < 256; c++) {
+        if ((c < 128 && isprint(c)) || c >= 128) keymap[c] = command_insert;
+    }
+    for (size_t i = 0; i < sizeof(default_bindings) / sizeof(default_bindings[0]); i++) {
+        keymap[default_bindings[i].key] = find_command(default_bindings[i].command, strlen(default_bindings[i].command))->run;
+    }
+    if (getenv("EDITOR_KEYS") != NULL) bind_keys(getenv("EDITOR_KEYS"));
+}
+
+void handle_key_press(int c) {
+    if (prompt.active) {
+        handle_prompt_key(c);
+    } else if (keymap[c] != NULL) {
+        keymap[c](c);
+    }
+
+    // Whatever the key was bound to, a paste only gets the one chance
+    if (c == KEY_PASTE) paste.size = 0;
+}
+
+/* Event handlers */
+
+// How long a partial escape sequence may wait for the rest of its bytes
+#define ESCAPE_TIMEOUT 50
+
+int escape_timer = -1;
+
+void handle_keys(bool flush) {
+    static int keys[INPUT_BUFFER_SIZE];
+
+    size_t count;
+    while (true) {
+        uint64_t start = stage_clock();
+        count = decode_keys(keys, INPUT_BUFFER_SIZE, flush);
+        record_stage(STAGE_DECODE, start);
+        if (count == 0) break;
+
+        start = stage_clock();
+        for (size_t i = 0; i < count; i++) {
+            handle_key_press(keys[i]);
+        }
+        record_stage(STAGE_EDIT, start);
+    }
+}
+
+void flush_escape(void *data) {
+    escape_timer = -1;
+    handle_keys(true);
+}
+
+// Reads whatever the terminal has ready and handles every key in it
+void handle_input(void *data) {
+    ssize_t n = terminal.read(&input.data[input.size], INPUT_BUFFER_SIZE - input.size);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    begin_event();
+    count_syscall(0);
+    if (n > 0) input.size += n;
+
+    cancel_timer(escape_timer);
+    escape_timer = -1;
+
+    handle_keys(false);
+    if (input.size > 0 && !input.pasting) escape_timer = add_timer(ESCAPE_TIMEOUT, 0, flush_escape, NULL);
+}
+
+// Appends the allocator statistics to the file named by EDITOR_ALLOC_STATS, if set
+void write_alloc_stats() {
+    const char *path = getenv("EDITOR_ALLOC_STATS");
+    if (path == NULL) return;
+
+    FILE *file = fopen(path, "a");
+    if (file == NULL) return;
+    for (size_t i = 0; i < buffers.count; i++) {
+        struct buffer *listed = buffers.list[i];
+        fprintf(file, "%s\n", listed->filename != NULL ? listed->filename : "[new]");
+        dump_alloc_stats(file, &listed->arena);
+    }
+    fclose(file);
+}
+
+void handle_signal(void *data) {
+    unsigned char signal;
+    while (read(loop.signal_pipe[0], &signal, 1) == 1) {
+        if (signal == SIGWINCH) size_screen();
+        if (signal == SIGUSR1) {
+            write_alloc_stats();
+            write_latency_stats();
+        }
+    }
+}
+
+/* Benchmarks */
+
+// Build with `cc -O2 -DBENCH main.c -o bench` and run `./bench [megabytes] [lines]`
+// to time the line scanners on megabytes of text, check a few keystroke
+// scripts come out right, then replay editing sessions on documents of 1K
+// lines up to the given number of lines
+#ifdef BENCH
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Lines of printable text with a spread of lengths, like a log file
+char *bench_text(size_t size) {
+    char *text = malloc(size);
+    if (text == NULL) die("bench_text");
+
+    unsigned seed = 1;
+    size_t i = 0;
+    while (i < size) {
+        seed = seed * 1103515245 + 12345;
+        size_t length = (seed >> 16) % 160;
+        for (size_t j = 0; j < length && i < size; j++, i++) text[i] = 'a' + (i + j) % 26;
+        if (i < size) text[i++] = '\n';
+    }
+    return text;
+}
+
+void bench_scanner(const char *name, size_t (*scan)(const char *, size_t, size_t *, size_t),
+                   const char *text, size_t size) {
+    size_t starts[INDEX_CHUNK_ROWS];
+    size_t lines = 0;
+    size_t checksum = 0;
+
+    double start = now_seconds();
+    size_t offset = 0;
+    while (offset < size) {
+        size_t found = scan(&text[offset], size - offset, starts, INDEX_CHUNK_ROWS);
+        if (found == 0) break;
+        for (size_t i = 0; i < found; i++) checksum += starts[i];
+        lines += found;
+        offset += starts[found - 1];
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("%-8s %10zu lines  %8.1f MB/s  (checksum %zx)\n",
+           name, lines, size / elapsed / (1 << 20), checksum);
+}
+
+// A terminal that reads from a script, a few bytes at a time like a person
+// typing or a whole read's worth like a paste, and throws away what is drawn
+// unless BENCH_CAPTURE names a file to keep it in
+struct {
+    const char *script;
+    size_t size;
+    size_t position;
+    size_t chunk;               // Most bytes a read hands out
+    size_t written;
+    FILE *capture;
+} headless;
+
+ssize_t headless_read(char *bytes, size_t size) {
+    size_t left = headless.size - headless.position;
+    if (left == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (size > headless.chunk) size = headless.chunk;
+    if (size > left) size = left;
+    memcpy(bytes, &headless.script[headless.position], size);
+    headless.position += size;
+    return size;
+}
+
+ssize_t headless_write(const char *bytes, size_t size) {
+    if (headless.capture != NULL) fwrite(bytes, 1, size, headless.capture);
+    headless.written += size;
+    return size;
+}
+
+void headless_get_size(int *rows, int *cols) {
+    *rows = 50;
+    *cols = 120;
+}
+
+// A script that is count repeats of a key
+char *repeat_key(const char *key, size_t count, size_t *size) {
+    size_t length = strlen(key);
+    char *script = malloc(length * count);
+    if (script == NULL) die("repeat_key");
+    for (size_t i = 0; i < count; i++) memcpy(&script[i * length], key, length);
+    *size = length * count;
+    return script;
+}
+
+// A bracketed paste of about size bytes of text, with line breaks sent as carriage returns
+char *paste_script(size_t size, size_t *script_size) {
+    char *text = bench_text(size);
+    for (size_t i = 0; i < size; i++) {
+        if (text[i] == '\n') text[i] = '\r';
+    }
+
+    char *script = malloc(size + 12);
+    if (script == NULL) die("paste_script");
+    memcpy(script, "\x1b[200~", 6);
+    memcpy(&script[6], text, size);
+    memcpy(&script[6 + size], "\x1b[201~", 6);
+    *script_size = size + 12;
+    free(text);
+    return script;
+}
+
+// Sets up count cursors one below the other, types keys characters at all
+// of them and goes back to one cursor
+char *cursors_script(size_t count, size_t keys, size_t *size) {
+    *size = count - 1 + keys + 4;
+    char *script = malloc(*size);
+    if (script == NULL) die("cursors_script");
+    memset(script, CTRL_PLUS('e'), count - 1);
+    for (size_t i = 0; i < keys; i++) script[count - 1 + i] = i % 8 == 7 ? ' ' : 'a' + i % 26;
+    memcpy(&script[count - 1 + keys], "\x1b\x1b[A", 4);
+    return script;
+}
+
+// Does what the event loop does between reads besides waiting: runs the done
+// callbacks of jobs the pool has finished and the timers that are due, such
+// as the one that hands swap records to the pool
+void run_pending() {
+    finish_jobs(NULL);
+    run_timers();
+}
+
+// Feeds script to the editor chunk bytes per read and renders a frame after
+// every read, the way the event loop would
+void run_session(const char *name, char *script, size_t size, size_t chunk) {
+    headless.script = script;
+    headless.size = size;
+    headless.position = 0;
+    headless.chunk = chunk;
+    headless.written = 0;
+    struct alloc_stats before = buffer->arena.stats;
+
+    size_t events = 0;
+    double start = now_seconds();
+    while (headless.position < headless.size) {
+        handle_input(NULL);
+        render();
+        flush_output();
+        run_pending();
+        events++;
+    }
+    double elapsed = now_seconds() - start;
+
+    struct alloc_stats *after = &buffer->arena.stats;
+    printf("  %-16s %8zu events %9.0f events/s %8.1f MB/s in %8.1f bytes out/event %9zu allocs %9zu frees\n",
+           name, events, events / elapsed, size / elapsed / (1 << 20), (double)headless.written / events,
+           after->allocs - before.allocs, after->frees - before.frees);
+    free(script);
+}
+
+// Runs command count times without going through the terminal or the keymap,
+// rendering a frame after each like run_session
+void run_commands(const char *name, const char *command, int key, size_t count) {
+    headless.written = 0;
+    struct alloc_stats before = buffer->arena.stats;
+
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+        run_command(command, key);
+        render();
+        flush_output();
+        run_pending();
+    }
+    double elapsed = now_seconds() - start;
+
+    struct alloc_stats *after = &buffer->arena.stats;
+    printf("  %-16s %8zu events %9.0f events/s %8s         %8.1f bytes out/event %9zu allocs %9zu frees\n",
+           name, count, count / elapsed, "", (double)headless.written / count,
+           after->allocs - before.allocs, after->frees - before.frees);
+}
+
+// Types script into a document of text, a byte per read, and checks that it
+// ends up as expected, for mistakes the timings wouldn't show
+bool check_script(const char *name, const char *text, const char *script, const char *expected) {
+    char path[] = "/tmp/editor-check-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) die("mkstemp");
+    if (write(fd, text, strlen(text)) != (ssize_t)strlen(text)) die("write");
+    close(fd);
+
+    open_file(path);
+    init_screen();
+    headless.script = script;
+    headless.size = strlen(script);
+    headless.position = 0;
+    headless.chunk = 1;
+    while (headless.position < headless.size) {
+        handle_input(NULL);
+    }
+
+    index_rows(SIZE_MAX);
+    size_t length = strlen(expected);
+    bool ok = true;
+    size_t offset = 0;
+    for (size_t y = 0; y < row_count() && ok; y++) {
+        struct row *row = get_row(y);
+        char line[256];
+        size_t size = copy_row(row, 0, line, sizeof(line));
+        ok = row->size == size && offset + size < length && memcmp(&expected[offset], line, size) == 0
+            && expected[offset + size] == '\n';
+        offset += size + 1;
+    }
+    ok = ok && offset == length;
+    printf("  %-16s %s\n", name, ok ? "ok" : "FAILED");
+
+    close_buffer();
+    unlink(path);
+    return ok;
+}
+
+// One undo takes back one keystroke, even the first one made at several cursors
+bool check_undo_steps() {
+    return check_script("undo keystroke", "111\n222\n", "\x1b[Babc\x1b[A\x05x\x1a", "111\nabc222\n");
+}
+
+// Writes a document of lines lines to a temporary file and returns its path
+char *bench_document(size_t lines) {
+    static char path[32];
+    strcpy(path, "/tmp/editor-bench-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd == -1) die("mkstemp");
+
+    FILE *file = fdopen(fd, "w");
+    if (file == NULL) die("fdopen");
+    unsigned seed = 1;
+    for (size_t i = 0; i < lines; i++) {
+        seed = seed * 1103515245 + 12345;
+        size_t length = (seed >> 16) % 80;
+        for (size_t j = 0; j < length; j++) fputc(j % 7 == 6 ? ' ' : 'a' + (i + j) % 26, file);
+        fputc('\n', file);
+    }
+    if (fclose(file) != 0) die("fclose");
+    return path;
+}
+
+void bench_sessions(size_t lines) {
+    char *path = bench_document(lines);
+    open_file(path);
+    init_screen();
+    printf("%zu lines\n", lines);
+
+    size_t size;
+    char *script;
+
+    script = repeat_key("a", 20000, &size);
+    run_session("typing", script, size, 1);
+    script = paste_script(4 << 20, &size);
+    run_session("paste", script, size, INPUT_BUFFER_SIZE);
+    script = repeat_key("\r", 20000, &size);
+    run_session("enter storm", script, size, 1);
+    script = repeat_key("\x7f", 20000, &size);
+    run_session("join backspaces", script, size, 1);
+    script = repeat_key("\x1b[B", 20000, &size);
+    run_session("scroll down", script, size, 3);
+    script = repeat_key("\x1b[A", 20000, &size);
+    run_session("scroll up", script, size, 3);
+    script = cursors_script(100, 20000, &size);
+    run_session("100 cursors", script, size, 1);
+    run_commands("insert command", "insert", 'a', 20000);
+    run_commands("move command", "move", KEY_DOWN, 20000);
+
+    printf("  %zu bytes in use, peak %zu bytes\n", buffer->arena.stats.in_use, buffer->arena.stats.peak_in_use);
+    close_buffer();
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    size_t size = (size_t)(argc > 1 ? atol(argv[1]) : 1024) << 20;
+    size_t max_lines = argc > 2 ? (size_t)atol(argv[2]) : 10000000;
+    char *text = bench_text(size);
+
+    printf("scanning %zu MB\n", size >> 20);
+    bench_scanner("scalar", scan_line_starts_scalar, text, size);
+#if defined(__x86_64__) || defined(__i386__)
+    bench_scanner("sse2", scan_line_starts_sse2, text, size);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) bench_scanner("avx2", scan_line_starts_avx2, text, size);
+#elif defined(__ARM_NEON)
+    bench_scanner("neon", scan_line_starts_neon, text, size);
+#endif
+    free(text);
+
+    // Set up like the editor itself, so that jobs and swap files cost what they really do
+    init_event_loop(handle_signal);
+    init_pool();
+    init_scanner();
+    init_buffer();
+    init_keymap();
+    terminal = (struct terminal){ .read = headless_read, .write = headless_write, .get_size = headless_get_size };
+    if (getenv("BENCH_CAPTURE") != NULL) headless.capture = fopen(getenv("BENCH_CAPTURE"), "w");
+    printf("checks\n");
+    if (!check_undo_steps()) return 1;
+    for (size_t lines = 1000; lines <= max_lines; lines *= 10) {
+        bench_sessions(lines);
+    }
+    return 0;
+}
+
+#else
+
+/* Main */
+
+int main(int argc, char **argv) {
+    enable_raw_mode();
+    init_screen();
+
+    init_event_loop(handle_signal);
+    watch_signal(SIGWINCH);
+    watch_signal(SIGUSR1);
+    atexit(write_alloc_stats);
+    atexit(write_latency_stats);
+    watch_fd(STDIN_FILENO, handle_input, NULL);
+    init_pool();
+
+    // Big files start counting their lines on the pool as soon as they are opened
+    init_scanner();
+    init_buffer();
+    init_keymap();
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) new_buffer();
+        if (!open_file(argv[i])) die("open");
+    }
+    if (argc > 2) switch_buffer(0);
+
+    while(1) {
+        uint64_t start = stage_clock();
+        render();
+        record_stage(STAGE_RENDER, start);
+        flush_output();
+        end_event();
+        poll_events();
+    }
+
+    return 0;
+}
+
+#endif